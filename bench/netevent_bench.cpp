@@ -0,0 +1,468 @@
+// Loopback benchmark: starts an EventServer and drives it with a multi-threaded load generator
+// in the same process, then reports throughput and latency percentiles.
+//
+// Scenarios:
+//   pingpong  one request in flight per connection, the server echoes it
+//   pipeline  --depth requests in flight per connection, echoed
+//   stream    every request asks for a --response bytes reply, like the demo server
+//   churn     connect, one request, close, repeated on every connection
+//
+// With --rate every connection sends on a fixed schedule and a latency is measured from the time
+// the request was due, so a stalled server is charged for the requests it held back.
+// Without it the load is closed-loop and the samples are corrected afterwards the way
+// HdrHistogram does, with the median latency as the expected interval.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_server.h"
+
+class BenchClient {
+public:
+    inline void SetFd(int fd) {
+        fd_ = fd;
+    }
+
+    inline void SetThreadIndex(int8_t index) {
+        threadIndex_ = index;
+    }
+
+    inline int GetFd() const {
+        return fd_;
+    }
+
+    inline int8_t GetThreadIndex() const {
+        return threadIndex_;
+    }
+
+private:
+    int fd_ = 0;
+    int8_t threadIndex_ = 0;
+};
+
+struct Options {
+    std::string scenario = "pingpong";
+    std::string rw = "both";// 0, 1 or both
+    int8_t type = 0;// BaseEvent::EVENT_TYPE_*, 0 means the platform default
+    bool edge = false;
+    int serverThreads = 2;
+    int loaders = 2;
+    int conns = 64;
+    int depth = 0;// requests in flight per connection, 0 picks the default of the scenario
+    double duration = 5;// seconds measured
+    double warmup = 1;// seconds before the measurement
+    double rate = 0;// requests per second over all connections, 0 means closed-loop
+    size_t size = 64;// request payload
+    size_t response = 100 * 1024;// reply payload of the stream scenario
+    uint16_t port = 19088;
+};
+
+struct LoadResult {
+    std::vector<int64_t> latencies;// ns
+    uint64_t requests = 0;
+    uint64_t bytes = 0;// received
+    uint64_t errors = 0;
+};
+
+// A connection of the load generator
+struct LoadConn {
+    int fd = -1;
+    std::string out;
+    size_t outPos = 0;
+    std::string in;
+    std::deque<int64_t> starts;// due time of every request in flight, in order
+    int64_t next = 0;// due time of the next request
+};
+
+static int64_t Clock() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void PutU32(char *p, uint32_t v) {
+    p[0] = static_cast<char>(v >> 24);
+    p[1] = static_cast<char>(v >> 16);
+    p[2] = static_cast<char>(v >> 8);
+    p[3] = static_cast<char>(v);
+}
+
+static uint32_t GetU32(const char *p) {
+    auto u = reinterpret_cast<const uint8_t *>(p);
+    return (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) |
+           (static_cast<uint32_t>(u[2]) << 8) | u[3];
+}
+
+static int Connect(uint16_t port, bool churn) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        return -1;
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (churn) {// reset on close, the ports would run out in TIME_WAIT otherwise
+        linger lg{1, 0};
+        ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static void CloseConn(LoadConn *c) {
+    if (c->fd >= 0) {
+        ::close(c->fd);
+    }
+    c->fd = -1;
+    c->out.clear();
+    c->outPos = 0;
+    c->in.clear();
+    c->starts.clear();
+}
+
+// Write what the socket takes, false when the connection is broken
+static bool FlushConn(LoadConn *c) {
+    while (c->outPos < c->out.size()) {
+        auto n = ::send(c->fd, c->out.data() + c->outPos, c->out.size() - c->outPos, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        c->outPos += n;
+    }
+    c->out.clear();
+    c->outPos = 0;
+    return true;
+}
+
+// Read the replies, record the latency of each complete one. false when the connection is broken
+static bool ReadConn(LoadConn *c, int64_t measureFrom, LoadResult *result) {
+    char buff[64 * 1024];
+    while (true) {
+        auto n = ::recv(c->fd, buff, sizeof(buff), 0);
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        c->in.append(buff, n);
+    }
+
+    auto now = Clock();
+    size_t pos = 0;
+    while (c->in.size() - pos >= 4) {
+        size_t frame = 4 + GetU32(c->in.data() + pos);
+        if (c->in.size() - pos < frame) {
+            break;
+        }
+        pos += frame;
+        if (c->starts.empty()) {// a reply nobody asked for
+            return false;
+        }
+        auto start = c->starts.front();
+        c->starts.pop_front();
+        if (start >= measureFrom) {
+            result->latencies.push_back(now - start);
+            result->requests++;
+            result->bytes += frame;
+        }
+    }
+    c->in.erase(0, pos);
+    return true;
+}
+
+static void RunLoader(const Options &opt, int index, int64_t begin, int64_t measureFrom, int64_t end,
+                      LoadResult *result) {
+    bool churn = opt.scenario == "churn";
+    int depth = opt.depth;
+    int count = opt.conns / opt.loaders + (index < opt.conns % opt.loaders ? 1 : 0);
+    // Every connection gets its share of the rate, the schedules are staggered
+    int64_t interval = opt.rate > 0 ? static_cast<int64_t>(1e9 * opt.conns / opt.rate) : 0;
+
+    std::string request(4 + opt.size, 'x');
+    PutU32(request.data(), static_cast<uint32_t>(opt.size));
+    PutU32(request.data() + 4, opt.scenario == "stream" ? static_cast<uint32_t>(opt.response) : 0);
+
+    std::vector<LoadConn> conns(count);
+    for (int i = 0; i < count; ++i) {
+        conns[i].next = begin + interval * (index + static_cast<int64_t>(i) * opt.loaders) / opt.conns;
+        if (!churn && (conns[i].fd = Connect(opt.port, false)) < 0) {
+            result->errors++;
+        }
+    }
+
+    std::vector<pollfd> pfds(count);
+    while (true) {
+        auto now = Clock();
+        if (now >= end) {
+            break;
+        }
+        auto wait = end - now;
+        for (int i = 0; i < count; ++i) {
+            auto &c = conns[i];
+            while (static_cast<int>(c.starts.size()) < depth && (interval == 0 || c.next <= now)) {
+                if (c.fd < 0 && (c.fd = Connect(opt.port, churn)) < 0) {
+                    result->errors++;
+                    break;
+                }
+                c.out += request;
+                c.starts.push_back(interval ? c.next : now);
+                c.next += interval;
+            }
+            if (interval && static_cast<int>(c.starts.size()) < depth) {
+                wait = std::min(wait, std::max<int64_t>(c.next - now, 0));
+            }
+            if (c.fd >= 0 && !FlushConn(&c)) {
+                result->errors++;
+                CloseConn(&c);
+            }
+            pfds[i].fd = c.fd;
+            pfds[i].events = static_cast<short>(POLLIN | (c.out.empty() ? 0 : POLLOUT));
+            pfds[i].revents = 0;
+        }
+
+        timespec ts{static_cast<time_t>(wait / 1000000000), static_cast<long>(wait % 1000000000)};
+        if (::ppoll(pfds.data(), pfds.size(), &ts, nullptr) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < count; ++i) {
+            auto &c = conns[i];
+            if (c.fd < 0 || pfds[i].revents == 0) {
+                continue;
+            }
+            if (!ReadConn(&c, measureFrom, result)) {
+                result->errors++;
+                CloseConn(&c);
+                continue;
+            }
+            if (churn && c.starts.empty()) {// the one request is answered, start over
+                CloseConn(&c);
+            }
+        }
+    }
+    for (auto &c: conns) {
+        CloseConn(&c);
+    }
+}
+
+// Add the samples a closed-loop generator missed while it waited for a slow reply,
+// like HdrHistogram's recordValueWithExpectedInterval
+static void CorrectCoordinatedOmission(std::vector<int64_t> *latencies) {
+    if (latencies->empty()) {
+        return;
+    }
+    std::vector<int64_t> sorted = *latencies;
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    auto expected = sorted[sorted.size() / 2];
+    if (expected <= 0) {
+        return;
+    }
+    auto size = latencies->size();
+    for (size_t i = 0; i < size; ++i) {
+        for (auto missing = (*latencies)[i] - expected; missing >= expected; missing -= expected) {
+            latencies->push_back(missing);
+        }
+    }
+}
+
+static double Percentile(const std::vector<int64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto rank = static_cast<size_t>(p / 100 * static_cast<double>(sorted.size() - 1) + 0.5);
+    return static_cast<double>(sorted[std::min(rank, sorted.size() - 1)]) / 1000;
+}
+
+// Run the scenario against a fresh server, return false when the server did not start
+static bool RunOnce(const Options &opt, bool rwSeparation, uint16_t port) {
+    EventServer<std::shared_ptr<BenchClient>> server(static_cast<int8_t>(opt.serverThreads));
+    server.AddListenAddr(SocketAddr("127.0.0.1", port));
+
+    // A request is [reply size][padding], a reply size of 0 asks for an echo
+    auto codec = std::make_shared<LengthCodec>(4);
+    auto filler = std::make_shared<std::string>(opt.response, 'y');
+    server.SetCodec(codec);
+    server.SetOnCreate([](int, std::shared_ptr<BenchClient> *client) {
+        *client = std::make_shared<BenchClient>();
+    });
+    server.SetOnMessage([&server, codec, filler](std::string &&msg, std::shared_ptr<BenchClient> &client) {
+        auto want = msg.size() >= 4 ? GetU32(msg.data()) : 0;
+        if (want == 0) {
+            server.SendPacket(client, codec->Encode(msg));
+        } else {
+            server.SendPacket(client, codec->Encode(std::string_view(*filler).substr(0, want)));
+        }
+    });
+    server.SetOnClose([](std::shared_ptr<BenchClient> &, std::string &&) {
+    });
+    server.SetRwSeparation(rwSeparation);
+    server.SetEventType(opt.type);
+    server.SetEdgeTrigger(opt.edge);
+
+    auto ret = server.StartServer();
+    if (!ret.first) {
+        fprintf(stderr, "server start failed: %s\n", ret.second.c_str());
+        return false;
+    }
+
+    Options load = opt;
+    load.port = port;
+    auto begin = Clock() + 10 * 1000 * 1000;// let every loader connect first
+    auto measureFrom = begin + static_cast<int64_t>(opt.warmup * 1e9);
+    auto end = measureFrom + static_cast<int64_t>(opt.duration * 1e9);
+    std::vector<LoadResult> results(opt.loaders);
+    std::vector<std::thread> loaders;
+    for (int i = 0; i < opt.loaders; ++i) {
+        loaders.emplace_back(RunLoader, std::cref(load), i, begin, measureFrom, end, &results[i]);
+    }
+    for (auto &t: loaders) {
+        t.join();
+    }
+    server.StopServer();
+
+    LoadResult total;
+    for (auto &r: results) {
+        total.latencies.insert(total.latencies.end(), r.latencies.begin(), r.latencies.end());
+        total.requests += r.requests;
+        total.bytes += r.bytes;
+        total.errors += r.errors;
+    }
+    if (opt.rate == 0) {
+        CorrectCoordinatedOmission(&total.latencies);
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+
+    printf("%-9s %2d %6d %5d %11llu %11.0f %9.1f %9.1f %9.1f %9.1f %9.1f %6llu\n",
+           opt.scenario.c_str(), rwSeparation ? 1 : 0, opt.conns, opt.depth,
+           static_cast<unsigned long long>(total.requests), static_cast<double>(total.requests) / opt.duration,
+           static_cast<double>(total.bytes) / opt.duration / (1024 * 1024), Percentile(total.latencies, 50),
+           Percentile(total.latencies, 99), Percentile(total.latencies, 99.9),
+           total.latencies.empty() ? 0.0 : static_cast<double>(total.latencies.back()) / 1000,
+           static_cast<unsigned long long>(total.errors));
+    fflush(stdout);
+    return true;
+}
+
+static void Usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --scenario pingpong|pipeline|stream|churn  (pingpong)\n"
+            "  --rw 0|1|both         read/write separation of the server (both)\n"
+            "  --type epoll|kqueue|uring  multiplexing of the server (platform default)\n"
+            "  --edge                edge-triggered epoll\n"
+            "  --threads N           server threads (2)\n"
+            "  --loaders N           load generator threads (2)\n"
+            "  --conns N             connections over all loaders (64)\n"
+            "  --depth N             requests in flight per connection (1, pipeline 16)\n"
+            "  --duration S          measured seconds (5)\n"
+            "  --warmup S            seconds before measuring (1)\n"
+            "  --rate R              requests per second over all connections, 0 is closed-loop (0)\n"
+            "  --size B              request payload (64)\n"
+            "  --response B          reply payload of the stream scenario (102400)\n"
+            "  --port P              first port, every run uses the next one (19088)\n", name);
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--edge") {
+            opt.edge = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            Usage(argv[0]);
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--scenario") {
+            opt.scenario = value;
+        } else if (arg == "--rw") {
+            opt.rw = value;
+        } else if (arg == "--type") {
+            opt.type = value == "uring" ? BaseEvent::EVENT_TYPE_URING :
+                       value == "kqueue" ? BaseEvent::EVENT_TYPE_KQUEUE : BaseEvent::EVENT_TYPE_EPOLL;
+        } else if (arg == "--threads") {
+            opt.serverThreads = atoi(value.c_str());
+        } else if (arg == "--loaders") {
+            opt.loaders = atoi(value.c_str());
+        } else if (arg == "--conns") {
+            opt.conns = atoi(value.c_str());
+        } else if (arg == "--depth") {
+            opt.depth = atoi(value.c_str());
+        } else if (arg == "--duration") {
+            opt.duration = atof(value.c_str());
+        } else if (arg == "--warmup") {
+            opt.warmup = atof(value.c_str());
+        } else if (arg == "--rate") {
+            opt.rate = atof(value.c_str());
+        } else if (arg == "--size") {
+            opt.size = strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--response") {
+            opt.response = strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--port") {
+            opt.port = static_cast<uint16_t>(atoi(value.c_str()));
+        } else {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.scenario != "pingpong" && opt.scenario != "pipeline" && opt.scenario != "stream" &&
+        opt.scenario != "churn") {
+        Usage(argv[0]);
+        return 1;
+    }
+    if (opt.depth <= 0 || opt.scenario == "churn") {
+        opt.depth = opt.scenario == "pipeline" ? 16 : 1;
+    }
+    opt.size = std::max<size_t>(opt.size, 4);// room for the reply size
+    opt.loaders = std::max(1, std::min(opt.loaders, opt.conns));
+    if (opt.serverThreads <= 0 || opt.conns <= 0 || opt.duration <= 0) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    printf("%-9s %2s %6s %5s %11s %11s %9s %9s %9s %9s %9s %6s\n", "scenario", "rw", "conns", "depth",
+           "requests", "req/s", "MB/s", "p50(us)", "p99(us)", "p999(us)", "max(us)", "errors");
+    uint16_t port = opt.port;
+    for (int rw: {0, 1}) {
+        if (opt.rw != "both" && opt.rw != std::to_string(rw)) {
+            continue;
+        }
+        // A stopped server keeps its port for a while, every run listens on a new one
+        if (!RunOnce(opt, rw == 1, port++)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -65,6 +65,7 @@ int main() {
     });
 
     g_server->SetRwSeparation(true);
+    g_server->SetZeroCopy(64 * 1024);// the responses above are around 100KB
 
     auto ret = g_server->StartServer();
     if (!ret.first) {
@@ -0,0 +1,89 @@
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "acceptor.h"
+
+Acceptor::~Acceptor() {
+    Stop();
+}
+
+bool Acceptor::Start() {
+    if (running_.exchange(true)) {
+        return false;
+    }
+    if (::pipe(stopFd_) != 0) {
+        running_ = false;
+        return false;
+    }
+    thread_ = std::thread([this] {
+        Loop();
+    });
+    return true;
+}
+
+void Acceptor::Stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    char signal = 1;
+    ::write(stopFd_[1], &signal, sizeof(signal));
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    ::close(stopFd_[0]);
+    ::close(stopFd_[1]);
+    stopFd_[0] = stopFd_[1] = -1;
+}
+
+void Acceptor::Loop() {
+    // The stop pipe comes first, the listen sockets follow in order
+    std::vector<struct pollfd> fds{{stopFd_[0], POLLIN, 0}};
+    for (auto &listen: listens_) {
+        fds.push_back({listen->Fd(), POLLIN, 0});
+    }
+    bool exhausted = false;// the listen sockets are left out of the poll until the wait is over
+    while (running_) {
+        if (::poll(fds.data(), fds.size(), exhausted ? exhaustedWait_ : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (fds[0].revents) {
+            return;
+        }
+        if (exhausted) {
+            exhausted = false;
+            for (size_t i = 1; i < fds.size(); ++i) {
+                fds[i].fd = listens_[i - 1]->Fd();
+            }
+            continue;
+        }
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if (fds[i].revents && Drain(listens_[i - 1].get())) {
+                exhausted = true;
+            }
+        }
+        if (exhausted) {// poll skips negative fds
+            for (size_t i = 1; i < fds.size(); ++i) {
+                fds[i].fd = -1;
+            }
+        }
+    }
+}
+
+bool Acceptor::Drain(ListenSocket *listen) {
+    // The listen socket is non-blocking, the loop ends with the backlog
+    while (true) {
+        int fd = listen->Accept();
+        if (fd >= 0) {
+            onAccept_(fd);
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        return errno == EMFILE || errno == ENFILE;
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "listen_socket.h"
+
+// A thread that only accepts. The server hands every accepted fd to the IO thread of its choice,
+// instead of the threads racing for the connections of one shared listen socket
+class Acceptor {
+public:
+    Acceptor(std::vector<std::shared_ptr<ListenSocket>> listens, std::function<void(int fd)> &&onAccept)
+            : listens_(std::move(listens)), onAccept_(std::move(onAccept)) {}
+
+    ~Acceptor();
+
+    Acceptor(const Acceptor &) = delete;
+
+    Acceptor &operator=(const Acceptor &) = delete;
+
+    // Start the accept thread
+    bool Start();
+
+    // Stop the accept thread and wait for it to exit
+    void Stop();
+
+private:
+    void Loop();
+
+    // Accept everything the listen socket has. Return true when the process is out of fds
+    // and the connection could not even be refused
+    bool Drain(ListenSocket *listen);
+
+    static constexpr int exhaustedWait_ = 100;// ms the listen sockets rest while the process is out of fds
+
+private:
+    std::vector<std::shared_ptr<ListenSocket>> listens_;// one per listen address
+    std::function<void(int fd)> onAccept_;// called on the accept thread
+    int stopFd_[2] = {-1, -1};// a pipe that Stop writes to end the poll
+    std::atomic<bool> running_ = false;
+    std::thread thread_;
+};
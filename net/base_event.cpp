@@ -0,0 +1,149 @@
+#include "config.h"
+
+#ifdef HAVE_EVENTFD
+
+#include <sys/eventfd.h>
+
+#endif
+
+#include "base_event.h"
+#include "stream_socket.h"
+
+BaseEvent::~BaseEvent() {
+    if (wakeupFd_[0] != -1) {
+        close(wakeupFd_[0]);
+    }
+    if (wakeupFd_[1] != wakeupFd_[0]) {
+        close(wakeupFd_[1]);
+    }
+    accepted_.Consume([](int fd) {// handed over after the loop stopped
+        close(fd);
+    });
+}
+
+void BaseEvent::PostSend(const std::shared_ptr<Connection> &conn, std::string &&msg) {
+    // Only the first message after a drain signals, the loop takes all of them at once
+    if (mailbox_.Push({conn, std::move(msg), FileSegment()})) {
+        Wakeup();
+    }
+}
+
+void BaseEvent::PostSendFile(const std::shared_ptr<Connection> &conn, FileSegment &&file) {
+    if (mailbox_.Push({conn, std::string(), std::move(file)})) {
+        Wakeup();
+    }
+}
+
+void BaseEvent::PostAccept(int fd) {
+    pendingAccepts_.fetch_add(1, std::memory_order_relaxed);
+    if (accepted_.Push(std::move(fd))) {
+        Wakeup();
+    }
+}
+
+void BaseEvent::RunInLoop(std::function<void()> &&task) {
+    if (InLoopThread()) {
+        task();
+        return;
+    }
+    if (tasks_.Push(std::move(task))) {
+        Wakeup();
+    }
+}
+
+void BaseEvent::QueueInLoop(std::function<void()> &&task) {
+    // A task queued by the loop itself runs at the end of the round, unless the tasks run already
+    if (tasks_.Push(std::move(task)) && (!InLoopThread() || runningTasks_)) {
+        Wakeup();
+    }
+}
+
+uint64_t BaseEvent::RunTimer(int64_t delay, int64_t interval, std::function<void()> &&callback) {
+    auto id = nextTimerId_.fetch_add(1, std::memory_order_relaxed);
+    auto posted = TimerWheel::Clock();
+    RunInLoop([this, id, delay, interval, posted, callback = std::move(callback)]() mutable {
+        // Count the time the task waited for the loop
+        timers_.Add(id, delay - (TimerWheel::Clock() - posted), interval, std::move(callback));
+    });
+    return id;
+}
+
+void BaseEvent::CancelTimer(uint64_t id) {
+    RunInLoop([this, id] {
+        timers_.Cancel(id);
+    });
+}
+
+void BaseEvent::EndRound() {
+    runningTasks_ = true;
+    tasks_.Consume([](std::function<void()> &&task) {
+        task();
+    });
+    runningTasks_ = false;
+    timers_.Advance(TimerWheel::Clock());
+    generation_.fetch_add(1, std::memory_order_release);
+}
+
+bool BaseEvent::OpenWakeup() {
+#ifdef HAVE_EVENTFD
+    // Blocking on purpose, io_uring returns EAGAIN for reads of non-blocking files instead of waiting
+    wakeupFd_[0] = eventfd(0, EFD_CLOEXEC);
+    wakeupFd_[1] = wakeupFd_[0];
+    return wakeupFd_[0] != -1;
+#else
+    return pipe(wakeupFd_) == 0;
+#endif
+}
+
+void BaseEvent::DrainWakeup() {
+    char buff[64];
+    ::read(wakeupFd_[0], buff, sizeof(buff));
+}
+
+void BaseEvent::DrainAccepted() {
+    accepted_.Consume([this](int fd) {
+        pendingAccepts_.fetch_sub(1, std::memory_order_relaxed);
+        stats_.accepts.Add(1);
+        auto socket = std::make_unique<StreamSocket>(fd, BaseSocket::SOCKET_TCP);
+        socket->OnCreate();
+        if (mode_ & EVENT_MODE_EDGE) {
+            socket->SetEdgeTrigger();
+        }
+        auto conn = Connection::Create(shared_from_this(), std::move(socket));
+        conn->fd_ = fd;
+        onCreate_(fd, conn);
+    });
+}
+
+void BaseEvent::DrainMailbox() {
+    DrainAccepted();
+    mailbox_.Consume([this](SendRequest &&request) {
+        auto &conn = request.conn;
+        if (conn->closed_) {
+            return;
+        }
+        // Same as a send from OnMessage: write right away, arm the write interest for the remainder
+        auto socket = static_cast<StreamSocket *>(conn->netEvent_.get());
+        auto ret = request.file.Valid() ? socket->WriteThrough(std::move(request.file))
+                                        : socket->WriteThrough(std::move(request.msg));
+        if (ret > 0) {
+            AddWriteEvent(conn.get());
+        } else if (ret == 0 && Drained(conn.get())) {
+            onClose_(conn.get(), "");
+        }
+    });
+}
+
+bool BaseEvent::OnEndOfStream(Connection *conn) {
+    if (conn->closed_ || conn->peerClosed_.exchange(true)) {
+        return false;
+    }
+    SetReadEnabled(conn, false);// a level-triggered fd would report the end of the stream forever
+    return Drained(conn);
+}
+
+bool BaseEvent::Drained(Connection *conn) {
+    // The flag is set before the queue is checked and the sending loop checks it after its flush,
+    // so at least one of both sees the other's change when they run at the same time
+    return conn->peerClosed_ && !conn->closed_ && static_cast<StreamSocket *>(conn->netEvent_.get())->Pending() == 0;
+}
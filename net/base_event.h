@@ -6,20 +6,34 @@
 #include <unistd.h>
 #include <map>
 #include <memory>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <utility>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "net_event.h"
+#include "block_pool.h"
 #include "callback_function.h"
+#include "loop_stats.h"
+#include "mpsc_queue.h"
+#include "send_queue.h"
+#include "timer_wheel.h"
 
 //class NetEvent;
 
+// The listen sockets a loop accepts on, one per listen address
+using ListenSockets = std::vector<std::shared_ptr<NetEvent>>;
+
 class BaseEvent : public std::enable_shared_from_this<BaseEvent> {
 public:
-    // Currently, there are two types of multiplexing: epoll and kqueue
+    // Currently, there are three types of multiplexing: epoll, kqueue and io_uring
     enum {
         EVENT_TYPE_EPOLL = 1,
         EVENT_TYPE_KQUEUE,
+        EVENT_TYPE_URING,
     };
 
     // Whether to enable read/write separation. If read/write separation is enabled,
@@ -28,6 +42,7 @@ public:
     enum {
         EVENT_MODE_READ = (1 << 0),//only read
         EVENT_MODE_WRITE = (1 << 1),//only write
+        EVENT_MODE_EDGE = (1 << 2),//edge-triggered, connections are registered once and drained until EAGAIN (epoll only)
     };
 
     // multiplexes event
@@ -36,22 +51,29 @@ public:
     const static int EVENT_ERROR;
     const static int EVENT_HUB;
 
-    BaseEvent(std::shared_ptr<NetEvent> listen, int8_t mode, int8_t type) : listen_(std::move(listen)), mode_(mode),
-                                                                            type_(type) {};
+    BaseEvent(ListenSockets listens, int8_t mode, int8_t type) : listens_(std::move(listens)), mode_(mode),
+                                                                 type_(type) {};
 
-    virtual ~BaseEvent() = default;
+    virtual ~BaseEvent();
 
-    // add fd to poll
-    virtual void AddEvent(int fd, int mask) = 0;
+    // add the connection fd to poll
+    virtual void AddEvent(Connection *conn, int mask) = 0;
 
     // delete fd from poll
     virtual void DelEvent(int fd) = 0;
 
     // add write event
-    virtual void AddWriteEvent(int fd) = 0;
+    virtual void AddWriteEvent(Connection *conn) = 0;
 
     // delete write event
-    virtual void DelWriteEvent(int fd) = 0;
+    virtual void DelWriteEvent(Connection *conn) = 0;
+
+    // Wait for the connect of an outbound connection to finish and then call onConnect_, loop thread only.
+    // The connection is registered like an accepted one with AddEvent after that
+    virtual void AddConnectEvent(Connection *conn) = 0;
+
+    // Stop or resume reading the connection, called on the loop thread
+    virtual void SetReadEnabled(Connection *conn, bool enabled) = 0;
 
     // poll event
     virtual void EventPoll() = 0;
@@ -65,27 +87,90 @@ public:
         }
         running_ = false;
 
-        char signal_byte = 'X';
-        ::write(pipeFd[1], &signal_byte, sizeof(signal_byte));//send signal to pipe，end poll loop
+        Wakeup();//signal the wakeup fd，end poll loop
         close(Fd());
     }
 
+    // Interrupt a blocked poll so that it finishes its round
+    void Wakeup() {
+        uint64_t signal = 1;// an eventfd takes 8 bytes, a pipe any amount
+        ::write(wakeupFd_[1], &signal, sizeof(signal));
+    }
+
+    // Hand a message to the loop from another thread. The loop queues and flushes it itself,
+    // so the socket and the poll interest are only touched by the loop thread
+    void PostSend(const std::shared_ptr<Connection> &conn, std::string &&msg);
+
+    // Same for a file segment, it stays in order with the messages
+    void PostSendFile(const std::shared_ptr<Connection> &conn, FileSegment &&file);
+
+    // Hand a connection accepted by another thread to the loop, from any thread. The loop creates
+    // its Connection and reports it through onCreate_ like a connection it accepted itself
+    void PostAccept(int fd);
+
+    // Connections handed over by PostAccept that the loop has not taken yet
+    inline int64_t PendingAccepts() const {
+        return pendingAccepts_.load(std::memory_order_relaxed);
+    }
+
+    // Run the task on the loop thread, right away when called from it
+    void RunInLoop(std::function<void()> &&task);
+
+    // Run the task on the loop thread at the end of the current round, also when called from it.
+    // Work queued by several callbacks of one round is then done once
+    void QueueInLoop(std::function<void()> &&task);
+
+    // Run the callback on the loop after delay ms, and then every interval ms when interval > 0.
+    // Callable from any thread, the callback must not block the loop. Return the id of the timer
+    uint64_t RunTimer(int64_t delay, int64_t interval, std::function<void()> &&callback);
+
+    // Cancel the timer, callable from any thread
+    void CancelTimer(uint64_t id);
+
+    inline bool InLoopThread() const {
+        return std::this_thread::get_id() == loopThread_.load(std::memory_order_relaxed);
+    }
+
+    // Number of finished poll rounds. Events are dispatched with the Connection pointer
+    // stored in the poll, a connection closed while a round runs may still show up in it,
+    // so its record is released only after the generation of every poll has moved on
+    inline uint64_t Generation() const {
+        return generation_.load(std::memory_order_acquire);
+    }
+
     inline int Fd() const {
         return fd_;
     }
 
+    // Counters of the loop, readable from any thread
+    inline LoopStats &Stats() {
+        return stats_;
+    }
+
     inline void SetOnCreate(std::function<void(int fd, std::shared_ptr<Connection>)> &&onCreate) {
         onCreate_ = std::move(onCreate);
     }
 
-    inline void SetOnMessage(std::function<void(int fd, std::string &&)> &&onMessage) {
+    inline void SetOnMessage(std::function<void(Connection *conn, std::string &&)> &&onMessage) {
         onMessage_ = std::move(onMessage);
     }
 
-    inline void SetOnClose(std::function<void(int fd, std::string &&)> &&onClose) {
+    inline void SetOnClose(std::function<void(Connection *conn, std::string &&)> &&onClose) {
         onClose_ = std::move(onClose);
     }
 
+    inline void SetOnConnect(std::function<void(Connection *conn)> &&onConnect) {
+        onConnect_ = std::move(onConnect);
+    }
+
+    // Whether the peer of the connection has finished and nothing is left to send for it,
+    // checked after a flush by the loop that sends. The connection is closed then
+    static bool Drained(Connection *conn);
+
+    inline void SetOnEndOfStream(std::function<void(Connection *conn)> &&onEndOfStream) {
+        onEndOfStream_ = std::move(onEndOfStream);
+    }
+
     inline void SetGetConn(std::function<std::shared_ptr<Connection>(int fd)> &&getConn) {
         getConn_ = std::move(getConn);
     }
@@ -94,33 +179,142 @@ public:
         return type_;
     }
 
+    inline int8_t Mode() const {
+        return mode_;
+    }
+
+    // Keep polling with a zero timeout for spin us after the last poll that returned events,
+    // and block only once that long passed without any. 0 (the default) always blocks.
+    // Set before the loop runs
+    inline void SetBusyPoll(int64_t spin) {
+        busyPollNs_ = spin * 1000;
+    }
+
 
 protected:
+    // Called by the loop thread before it polls the first time
+    inline void StartLoop() {
+        loopThread_ = std::this_thread::get_id();
+        LoopStats::SetCurrent(&stats_);
+        BlockPool::Attach();
+    }
+
+    // Called at the end of each poll round, runs the posted tasks and the due timers
+    void EndRound();
+
+    // Count a return of the poll and the events it reported
+    inline void CountPoll(int events) {
+        stats_.polls.Add(1);
+        if (events > 0) {
+            stats_.events.Add(events);
+            if (busyPollNs_ > 0) {
+                lastActive_ = std::chrono::steady_clock::now();
+            }
+        }
+    }
+
+    // Timeout of the poll in ms, -1 when no timer is armed. 0 while busy polling
+    inline int PollTimeout() {
+        auto timeout = timers_.Timeout();
+        if (busyPollNs_ <= 0 || timeout == 0) {
+            return timeout;
+        }
+        if (std::chrono::steady_clock::now() - lastActive_ < std::chrono::nanoseconds(busyPollNs_)) {
+            stats_.spins.Add(1);
+            return 0;
+        }
+        stats_.sleeps.Add(1);
+        return timeout;
+    }
+
+    // Create the fd that Wakeup() signals: an eventfd where available, a pipe otherwise.
+    // wakeupFd_[0] is polled, wakeupFd_[1] is written
+    bool OpenWakeup();
+
+    // Consume the signals of the wakeup fd
+    void DrainWakeup();
+
+    // Send the messages posted by other threads, called by the loop after a wakeup
+    virtual void DrainMailbox();
+
+    // The peer sent its last byte, called by the loop that reads. Reading stops and the connection
+    // is closed once the data queued for it is sent, so the answer to a request the peer sent
+    // before shutting down its side still reaches it. Return whether it can be closed right away
+    bool OnEndOfStream(Connection *conn);
+
+    // Serve the connections handed over by PostAccept, called by the loop after a wakeup
+    void DrainAccepted();
+
+    // The listen socket the poll reported the event for, nullptr for any other fd
+    inline NetEvent *FindListen(const void *ptr) const {
+        for (auto &listen: listens_) {
+            if (listen.get() == ptr) {
+                return listen.get();
+            }
+        }
+        return nullptr;
+    }
+
+    // A message posted to the loop
+    struct SendRequest {
+        std::shared_ptr<Connection> conn;
+        std::string msg;
+        FileSegment file;// sent instead of msg when valid
+    };
+
     int fd_ = 0;//event fd
     bool running_ = true;
+    bool runningTasks_ = false;// EndRound is running the tasks, only touched by the loop thread
+
+    std::atomic<uint64_t> generation_ = 0;// finished poll rounds
 
     // Type of multiplexing supported.
     // If read/write fractions are not enabled,
     // write events must be processed simultaneously in the read multiplexing
     const int8_t mode_ = 0;
 
-    // The type of the current multiplexing is epoll or kqueue
+    // The type of the current multiplexing is epoll, kqueue or io_uring
     const int8_t type_ = 0;
 
-    int pipeFd[2];
+    int wakeupFd_[2] = {-1, -1};
+
+    MpscQueue<SendRequest> mailbox_;// messages posted by other threads
+
+    MpscQueue<int> accepted_;// connections accepted by another thread
+    std::atomic<int64_t> pendingAccepts_ = 0;
+
+    MpscQueue<std::function<void()>> tasks_;// tasks posted by other threads
 
-    // listening socket
-    std::shared_ptr<NetEvent> listen_;
+    TimerWheel timers_;// only touched by the loop thread
+
+    LoopStats stats_;
+
+    std::atomic<uint64_t> nextTimerId_ = 1;
+
+    std::atomic<std::thread::id> loopThread_;
+
+    int64_t busyPollNs_ = 0;// spin budget after the last events, 0 disables busy polling
+    std::chrono::steady_clock::time_point lastActive_;// the last poll that returned events, loop thread only
+
+    // listening sockets, empty when another thread accepts
+    ListenSockets listens_;
 
     // callback function when a new connection is created
     std::function<void(int fd, std::shared_ptr<Connection>)> onCreate_;
 
     // callback function when a message is received
-    std::function<void(int fd, std::string &&)> onMessage_;
+    std::function<void(Connection *conn, std::string &&)> onMessage_;
 
     // callback function when a connection is closed
-    std::function<void(int fd, std::string &&)> onClose_;
+    std::function<void(Connection *conn, std::string &&)> onClose_;
+
+    // callback function when the connect of an outbound connection finished, successfully or not
+    std::function<void(Connection *conn)> onConnect_;
+
+    // callback function when the peer of a connection has finished and nothing is queued for it,
+    // for the multiplexes whose sends are posted: the close goes to the loop that sends, behind them
+    std::function<void(Connection *conn)> onEndOfStream_;
 
-    // get connection by fd
+    // get connection by fd, for the multiplexes that cannot store the Connection in the poll
     std::function<std::shared_ptr<Connection>(int fd)> getConn_;
 };
@@ -3,19 +3,28 @@
 #include <unistd.h>
 #include <netinet/tcp.h>
 
+#include "config.h"
 #include "base_socket.h"
 
-int BaseSocket::CreateTCPSocket() {
-    return ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+#ifdef HAVE_REUSEPORT_CBPF
+
+#include <algorithm>
+#include <linux/filter.h>
+
+#endif
+
+int BaseSocket::CreateTCPSocket(int family) {
+    return ::socket(family, SOCK_STREAM, AF_UNIX == family ? 0 : IPPROTO_TCP);
 }
 
-int BaseSocket::CreateUDPSocket() {
-    return ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+int BaseSocket::CreateUDPSocket(int family) {
+    return ::socket(family, SOCK_DGRAM, IPPROTO_UDP);
 }
 
 void BaseSocket::Close() {
+    // -1 rather than 0 keeps a late read or write on this socket away from stdin
     auto fd = Fd();
-    if (fd_.compare_exchange_strong(fd, 0)) {
+    if (fd > 0 && fd_.compare_exchange_strong(fd, -1)) {
         ::shutdown(fd, SHUT_RDWR);
         ::close(fd);
     }
@@ -70,12 +79,27 @@ bool BaseSocket::SetReusePort() {
     return ::setsockopt(Fd(), SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char *>(&reuse), sizeof(reuse)) != -1;
 }
 
+bool BaseSocket::SetBusyPoll(int us) {
+#ifdef HAVE_BUSY_POLL
+    if (::setsockopt(Fd(), SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) != 0) {
+        return false;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = us > 0 ? 1 : 0;
+    ::setsockopt(Fd(), SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+    return true;
+#else
+    return false;
+#endif
+}
+
 bool BaseSocket::GetLocalAddr(SocketAddr &addr) {
-    sockaddr_in localAddr{};
+    sockaddr_storage localAddr{};
     socklen_t len = sizeof(localAddr);
 
     if (0 == ::getsockname(Fd(), reinterpret_cast<struct sockaddr *>(&localAddr), &len)) {
-        addr.Init(localAddr);
+        addr.Init(reinterpret_cast<struct sockaddr *>(&localAddr), len);
     } else {
         return false;
     }
@@ -84,13 +108,69 @@ bool BaseSocket::GetLocalAddr(SocketAddr &addr) {
 }
 
 bool BaseSocket::GetPeerAddr(SocketAddr &addr) {
-    sockaddr_in remoteAddr{};
+    sockaddr_storage remoteAddr{};
     socklen_t len = sizeof(remoteAddr);
     if (0 == ::getpeername(Fd(), reinterpret_cast<struct sockaddr *>(&remoteAddr), &len)) {
-        addr.Init(remoteAddr);
+        addr.Init(reinterpret_cast<struct sockaddr *>(&remoteAddr), len);
     } else {
         return false;
     }
 
     return true;
 }
+
+bool BaseSocket::AttachCpuSteering(const std::vector<int> &threadCpus) {
+#ifdef HAVE_REUSEPORT_CBPF
+    if (threadCpus.empty()) {
+        return false;
+    }
+    // Sockets grouped by the cpu their thread is pinned to, in group order
+    std::vector<std::pair<int, std::vector<uint32_t>>> cpus;
+    for (size_t i = 0; i < threadCpus.size(); ++i) {
+        auto it = std::find_if(cpus.begin(), cpus.end(), [&](const auto &c) { return c.first == threadCpus[i]; });
+        if (it == cpus.end()) {
+            it = cpus.insert(cpus.end(), {threadCpus[i], {}});
+        }
+        it->second.push_back(static_cast<uint32_t>(i));
+    }
+
+    // X = flow hash, random when the device did not compute one; A = receiving cpu.
+    // A cpu with several threads spreads over their sockets as hash % count, the flow
+    // of a datagram socket stays on one of them. A cpu without a thread spreads as cpu % sockets
+    std::vector<sock_filter> code;
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_RXHASH)));
+    code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1));
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_RANDOM)));
+    code.push_back(BPF_STMT(BPF_MISC | BPF_TAX, 0));
+    code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+    for (const auto &[cpu, sockets]: cpus) {
+        auto count = sockets.size();
+        // Jump offsets are 8 bits
+        auto block = count == 1 ? 1 : 2 + 2 * (count - 1) + 1;
+        if (block > 255) {
+            return false;
+        }
+        code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(cpu), 0, static_cast<uint8_t>(block)));
+        if (count == 1) {
+            code.push_back(BPF_STMT(BPF_RET | BPF_K, sockets.front()));
+            continue;
+        }
+        code.push_back(BPF_STMT(BPF_MISC | BPF_TXA, 0));
+        code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(count)));
+        for (size_t j = 0; j + 1 < count; ++j) {
+            code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(j), 0, 1));
+            code.push_back(BPF_STMT(BPF_RET | BPF_K, sockets[j]));
+        }
+        code.push_back(BPF_STMT(BPF_RET | BPF_K, sockets.back()));
+    }
+    code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(threadCpus.size())));
+    code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+
+    sock_fprog prog{};
+    prog.len = static_cast<unsigned short>(code.size());
+    prog.filter = code.data();
+    return ::setsockopt(Fd(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+#else
+    return false;
+#endif
+}
@@ -1,9 +1,14 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <cstddef>
 #include <cstring>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <algorithm>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <functional>
 #include <sys/socket.h>
 
@@ -12,60 +17,179 @@
 
 static constexpr int SOCKET_WIN_SIZE = 128 * 1024;
 
+// An IPv4, IPv6 or unix domain socket address
 struct SocketAddr {
     SocketAddr() { Clear(); }
 
-    SocketAddr(const SocketAddr &other) { memcpy(&addr_, &other.addr_, sizeof addr_); }
+    SocketAddr(const SocketAddr &other) { memcpy(&addr_, &other.addr_, sizeof addr_); length_ = other.length_; }
 
     SocketAddr &operator=(const SocketAddr &other) {
         if (this != &other) {
             memcpy(&addr_, &other.addr_, sizeof addr_);
+            length_ = other.length_;
         }
         return *this;
     }
 
     SocketAddr(const sockaddr_in &addr) { Init(addr); }
 
+    SocketAddr(const sockaddr *addr, socklen_t length) { Init(addr, length); }
+
     SocketAddr(uint32_t netip, uint16_t netport) { Init(netip, netport); }
 
+    // An IPv4 address, or an IPv6 one when ip contains a colon
     SocketAddr(const std::string &ip, uint16_t hostport) { Init(ip, hostport); }
 
-    void Init(const sockaddr_in &addr) { memcpy(&addr_, &addr, sizeof(addr)); }
+    // A unix domain socket at the path, a path starting with @ names one in the abstract namespace (Linux)
+    static SocketAddr Unix(const std::string &path) {
+        SocketAddr addr;
+        auto &un = reinterpret_cast<sockaddr_un &>(addr.addr_);
+        un.sun_family = AF_UNIX;
+        auto size = std::min(path.size(), sizeof(un.sun_path) - 1);
+        memcpy(un.sun_path, path.data(), size);
+        if (size > 0 && path[0] == '@') {
+            un.sun_path[0] = '\0';// the name is not terminated, the length tells where it ends
+        }
+        addr.length_ = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + size + (un.sun_path[0] ? 1 : 0));
+        return addr;
+    }
+
+    void Init(const sockaddr_in &addr) { Init(reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)); }
+
+    void Init(const sockaddr *addr, socklen_t length) {
+        Clear();
+        length_ = std::min<socklen_t>(length, sizeof(addr_));
+        memcpy(&addr_, addr, length_);
+    }
 
     void Init(uint32_t netIp, uint16_t netPort) {
-        addr_.sin_family = AF_INET;
-        addr_.sin_addr.s_addr = netIp;
-        addr_.sin_port = netPort;
+        Clear();
+        auto &in = reinterpret_cast<sockaddr_in &>(addr_);
+        in.sin_family = AF_INET;
+        in.sin_addr.s_addr = netIp;
+        in.sin_port = netPort;
+        length_ = sizeof(sockaddr_in);
     }
 
     void Init(const std::string &ip, uint16_t hostPort) {
-        addr_.sin_family = AF_INET;
-        addr_.sin_addr.s_addr = ::inet_addr(ip.data());
-        addr_.sin_port = htons(hostPort);
+        Clear();
+        if (ip.find(':') != std::string::npos) {
+            auto &in6 = reinterpret_cast<sockaddr_in6 &>(addr_);
+            in6.sin6_family = AF_INET6;
+            in6.sin6_port = htons(hostPort);
+            if (::inet_pton(AF_INET6, ip.data(), &in6.sin6_addr) != 1) {
+                Clear();
+                return;
+            }
+            length_ = sizeof(sockaddr_in6);
+            return;
+        }
+        Init(::inet_addr(ip.data()), htons(hostPort));
     }
 
-    const sockaddr_in &GetAddr() const { return addr_; }
+    // The address as IPv4, only valid when Family() is AF_INET
+    const sockaddr_in &GetAddr() const { return reinterpret_cast<const sockaddr_in &>(addr_); }
 
-    inline std::string GetIP() const { return ::inet_ntoa(addr_.sin_addr); }
+    // The address for bind, connect and sendto
+    inline const sockaddr *Data() const { return reinterpret_cast<const sockaddr *>(&addr_); }
+
+    inline socklen_t Length() const { return length_; }
+
+    inline int Family() const { return addr_.ss_family; }
+
+    // The IP address, or the path of a unix domain socket
+    inline std::string GetIP() const {
+        char buf[INET6_ADDRSTRLEN];
+        return GetIP(buf, sizeof(buf));
+    }
 
     inline std::string GetIP(char *buf, socklen_t size) const {
-        return ::inet_ntop(AF_INET, reinterpret_cast<const char *>(&addr_.sin_addr), buf, size);
+        switch (Family()) {
+            case AF_INET:
+                return ::inet_ntop(AF_INET, &GetAddr().sin_addr, buf, size) ? buf : "";
+            case AF_INET6:
+                return ::inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6 &>(addr_).sin6_addr, buf, size) ? buf
+                                                                                                                  : "";
+            case AF_UNIX:
+                return Path();
+            default:
+                return "";
+        }
+    }
+
+    // 0 for a unix domain socket
+    inline uint16_t GetPort() const {
+        switch (Family()) {
+            case AF_INET:
+                return ntohs(GetAddr().sin_port);
+            case AF_INET6:
+                return ntohs(reinterpret_cast<const sockaddr_in6 &>(addr_).sin6_port);
+            default:
+                return 0;
+        }
     }
 
-    inline uint16_t GetPort() const { return ntohs(addr_.sin_port); }
+    // The path of a unix domain socket, an abstract name starts with @
+    inline std::string Path() const {
+        if (Family() != AF_UNIX || length_ <= offsetof(sockaddr_un, sun_path)) {
+            return "";
+        }
+        auto &un = reinterpret_cast<const sockaddr_un &>(addr_);
+        size_t size = length_ - offsetof(sockaddr_un, sun_path);
+        if (un.sun_path[0] == '\0') {
+            return "@" + std::string(un.sun_path + 1, size - 1);
+        }
+        return std::string(un.sun_path, strnlen(un.sun_path, size));
+    }
 
-    inline bool Empty() const { return 0 == addr_.sin_family; }
+    inline bool Empty() const { return 0 == addr_.ss_family; }
 
-    void Clear() { memset(&addr_, 0, sizeof addr_); }
+    void Clear() {
+        memset(&addr_, 0, sizeof addr_);
+        length_ = 0;
+    }
 
     inline friend bool operator==(const SocketAddr &a, const SocketAddr &b) {
-        return a.addr_.sin_family == b.addr_.sin_family && a.addr_.sin_addr.s_addr == b.addr_.sin_addr.s_addr &&
-               a.addr_.sin_port == b.addr_.sin_port;
+        if (a.Family() != b.Family()) {
+            return false;
+        }
+        switch (a.Family()) {
+            case AF_INET:
+                return a.GetAddr().sin_addr.s_addr == b.GetAddr().sin_addr.s_addr &&
+                       a.GetAddr().sin_port == b.GetAddr().sin_port;
+            case AF_INET6: {
+                auto &a6 = reinterpret_cast<const sockaddr_in6 &>(a.addr_);
+                auto &b6 = reinterpret_cast<const sockaddr_in6 &>(b.addr_);
+                return a6.sin6_port == b6.sin6_port && a6.sin6_scope_id == b6.sin6_scope_id &&
+                       memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr)) == 0;
+            }
+            default:
+                return a.length_ == b.length_ && memcmp(&a.addr_, &b.addr_, a.length_) == 0;
+        }
     }
 
     inline friend bool operator!=(const SocketAddr &a, const SocketAddr &b) { return !(a == b); }
 
-    sockaddr_in addr_{};
+    sockaddr_storage addr_{};
+    socklen_t length_ = 0;
+};
+
+template<>
+struct std::hash<SocketAddr> {
+    size_t operator()(const SocketAddr &addr) const noexcept {
+        switch (addr.Family()) {
+            case AF_INET:
+                return (static_cast<size_t>(addr.GetAddr().sin_addr.s_addr) << 16) ^ addr.GetAddr().sin_port;
+            case AF_INET6: {
+                auto &in6 = reinterpret_cast<const sockaddr_in6 &>(addr.addr_);
+                return std::hash<std::string_view>()(std::string_view(
+                        reinterpret_cast<const char *>(&in6.sin6_addr), sizeof(in6.sin6_addr))) ^ in6.sin6_port;
+            }
+            default:
+                return std::hash<std::string_view>()(std::string_view(
+                        reinterpret_cast<const char *>(&addr.addr_), addr.Length()));
+        }
+    }
 };
 
 
@@ -88,9 +212,10 @@ public:
 
     void Close() override;
 
-    static int CreateTCPSocket();
+    // A stream socket of the address family, AF_UNIX included
+    static int CreateTCPSocket(int family = AF_INET);
 
-    static int CreateUDPSocket();
+    static int CreateUDPSocket(int family = AF_INET);
 
 
     // Called when the socket is created
@@ -108,6 +233,19 @@ public:
 
     bool SetReusePort();
 
+    // Let the kernel poll the device queue for up to us microseconds when a read or a poll
+    // on the socket would block, instead of waiting for the interrupt (SO_BUSY_POLL), and prefer
+    // that over the interrupt while the application keeps polling (SO_PREFER_BUSY_POLL).
+    // Raising it above the net.core.busy_read sysctl needs CAP_NET_ADMIN. Return false when refused
+    bool SetBusyPoll(int us);
+
+    // Steer each packet of the SO_REUSEPORT group to the socket whose thread runs on
+    // the cpu that received it, new connections for TCP and datagrams for UDP. The sockets
+    // join the group in the order they bind, threadCpus[i] is the cpu of the thread that owns
+    // the i-th one; the sockets sharing a cpu split its packets by flow hash. Return false
+    // when the kernel does not support it, the group then hashes
+    bool AttachCpuSteering(const std::vector<int> &threadCpus);
+
     bool GetLocalAddr(SocketAddr &);
 
     bool GetPeerAddr(SocketAddr &);
@@ -0,0 +1,113 @@
+#include <new>
+
+#include "block_pool.h"
+
+// Holds the pool of the thread, the thread's reference is dropped when it exits
+struct PoolOwner {
+    ~PoolOwner() {
+        if (pool) {
+            auto owned = pool;
+            pool = nullptr;
+            owned->Release();
+        }
+    }
+
+    BlockPool *pool = nullptr;
+};
+
+namespace {
+
+thread_local PoolOwner owner;
+
+}
+
+void BlockPool::Attach() {
+    if (!owner.pool) {
+        owner.pool = new BlockPool();
+    }
+}
+
+void *BlockPool::Allocate(size_t size) {
+    auto pool = owner.pool;
+    auto index = (size + sizeof(Header) - 1) / classSize_;
+    if (!pool || index >= classes_) {
+        auto header = static_cast<Header *>(::operator new(size + sizeof(Header)));
+        header->pool = nullptr;
+        header->index = 0;
+        return header + 1;
+    }
+    if (!pool->free_[index]) {
+        pool->TakeReturned();
+    }
+    auto header = pool->free_[index];
+    if (header) {
+        pool->free_[index] = *reinterpret_cast<Header **>(header + 1);
+        --pool->count_[index];
+    } else {
+        header = static_cast<Header *>(::operator new((index + 1) * classSize_));
+        header->pool = pool;
+        header->index = static_cast<uint32_t>(index);
+    }
+    pool->refs_.fetch_add(1, std::memory_order_relaxed);
+    return header + 1;
+}
+
+void BlockPool::Deallocate(void *block) {
+    if (!block) {
+        return;
+    }
+    auto header = static_cast<Header *>(block) - 1;
+    auto pool = header->pool;
+    if (!pool) {
+        ::operator delete(header);
+        return;
+    }
+    if (pool == owner.pool) {
+        pool->Keep(header);
+        pool->refs_.fetch_sub(1, std::memory_order_relaxed);// the thread still holds one
+        return;
+    }
+    auto &next = *reinterpret_cast<Header **>(block);
+    next = pool->returned_.load(std::memory_order_relaxed);
+    while (!pool->returned_.compare_exchange_weak(next, header, std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+    }
+    pool->Release();
+}
+
+BlockPool::~BlockPool() {
+    TakeReturned();
+    for (auto &head: free_) {
+        while (head) {
+            auto header = head;
+            head = *reinterpret_cast<Header **>(header + 1);
+            ::operator delete(header);
+        }
+    }
+}
+
+void BlockPool::Release() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+void BlockPool::TakeReturned() {
+    auto header = returned_.exchange(nullptr, std::memory_order_acquire);
+    while (header) {
+        auto next = *reinterpret_cast<Header **>(header + 1);
+        Keep(header);
+        header = next;
+    }
+}
+
+void BlockPool::Keep(Header *header) {
+    auto index = header->index;
+    if (count_[index] >= maxFree_) {
+        ::operator delete(header);
+        return;
+    }
+    *reinterpret_cast<Header **>(header + 1) = free_[index];
+    free_[index] = header;
+    ++count_[index];
+}
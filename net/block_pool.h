@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Memory for the per connection objects of one IO thread: the Connection, its socket, the entry
+// of the server and the blocks of the send queue. Accepting and closing connections reuses the
+// blocks of earlier ones instead of going to the global allocator. A block goes back to the pool
+// it came from also when it is freed on another thread: such blocks are pushed to a lock-free list
+// that the owner takes over with one exchange once its own list of the class runs dry.
+// Blocks are grouped in size classes of classSize_ bytes, larger ones and those allocated
+// outside of an IO thread come from the heap
+class BlockPool {
+public:
+    // Give the calling thread a pool, called by an event loop before it polls the first time.
+    // The pool lives until the thread has exited and the last of its blocks is freed
+    static void Attach();
+
+    // From the pool of the calling thread, from the heap when it has none
+    static void *Allocate(size_t size);
+
+    // From any thread, the block must come from Allocate
+    static void Deallocate(void *block);
+
+    static constexpr size_t classSize_ = 64;
+    static constexpr size_t classes_ = 32;// pooled up to 2KB including the header
+    static constexpr size_t maxFree_ = 1024;// blocks kept per class
+
+private:
+    // In front of every block, it keeps the block 16-byte aligned
+    struct alignas(16) Header {
+        BlockPool *pool;// nullptr for a block from the heap
+        uint32_t index;// size class
+    };
+
+    BlockPool() = default;
+
+    ~BlockPool();
+
+    // Drop a reference, the pool is deleted with the last one
+    void Release();
+
+    // Move the blocks freed by other threads to the lists of their classes
+    void TakeReturned();
+
+    void Keep(Header *header);
+
+    Header *free_[classes_] = {};// linked through the first word after the header
+    size_t count_[classes_] = {};
+
+    std::atomic<Header *> returned_ = nullptr;// blocks freed by other threads
+
+    // One for every block in use and one for the thread
+    std::atomic<int64_t> refs_ = 1;
+
+    friend struct PoolOwner;
+};
+
+// Allocator for the containers and shared_ptrs of the IO threads, see BlockPool
+template<typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    static_assert(alignof(T) <= 16, "BlockPool blocks are 16-byte aligned");
+
+    PoolAllocator() noexcept = default;
+
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+    inline T *allocate(size_t n) {
+        return static_cast<T *>(BlockPool::Allocate(n * sizeof(T)));
+    }
+
+    inline void deallocate(T *p, size_t) noexcept {
+        BlockPool::Deallocate(p);
+    }
+
+    template<typename U>
+    friend bool operator==(const PoolAllocator &, const PoolAllocator<U> &) noexcept {
+        return true;
+    }
+};
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <string>
+
+#include "block_pool.h"
 
 template<typename T>
 struct IsPointer : std::false_type {
@@ -40,6 +44,13 @@ using OnMessage = std::function<void(std::string &&msg, T &t)>;
 template<typename T> requires HasSetFdFunction<T>
 using OnClose = std::function<void(T & t, std::string && err)>;
 
+// t is nullptr when the connection could not be made, err tells why
+template<typename T> requires HasSetFdFunction<T>
+using OnConnect = std::function<void(T *t, std::string &&err)>;
+
+template<typename T> requires HasSetFdFunction<T>
+using OnHighWatermark = std::function<void(T &t, size_t pending)>;
+
 class BaseEvent;
 
 class NetEvent;
@@ -49,10 +60,44 @@ struct Connection {
     explicit Connection(const std::shared_ptr<BaseEvent> &poll, std::unique_ptr<NetEvent> netEvent)
             : poll_(poll), netEvent_(std::move(netEvent)) {}
 
+    // A connection from the pool of the calling IO thread
+    static inline std::shared_ptr<Connection> Create(const std::shared_ptr<BaseEvent> &poll,
+                                                     std::unique_ptr<NetEvent> netEvent = nullptr) {
+        return std::allocate_shared<Connection>(PoolAllocator<Connection>(), poll, std::move(netEvent));
+    }
+
     ~Connection() = default;
 
     std::shared_ptr<BaseEvent> poll_;
     std::unique_ptr<NetEvent> netEvent_;
 
     int fd_ = 0;
+
+    // Set when the connection is closed. The record itself stays valid until every
+    // multiplex that may still report it has finished its round
+    std::atomic<bool> closed_ = false;
+
+    // Set when the peer has sent its last byte. Reading stops and the connection
+    // is closed once the data queued for it is sent, see BaseEvent::OnEndOfStream
+    std::atomic<bool> peerClosed_ = false;
+
+    // Data of the owner of the connection, reached from the event without a lookup
+    void *context_ = nullptr;
+
+    // Idle timeout: time of the last read in ms and the timer that checks it, read thread only
+    int64_t lastActive_ = 0;
+    std::atomic<uint64_t> idleTimer_ = 0;
+
+    // Received data that does not complete a frame yet, read thread only.
+    // The next read appends to it, readPos_ is where the undecoded part starts
+    // and readScanned_ how much of that the codec has examined already
+    std::string readBuff_;
+    size_t readPos_ = 0;
+    size_t readScanned_ = 0;
+
+    // Poll interest of the read multiplex, read thread only
+    bool readPaused_ = false;// reads stopped until the unsent data drains
+    bool writeArmed_ = false;// write interest set in a level-triggered multiplex
+    bool connecting_ = false;// an outbound connection waiting for its connect to finish
+    bool zeroCopy_ = false;// sends may use MSG_ZEROCOPY, the error queue of the socket reports their completion
 };
\ No newline at end of file
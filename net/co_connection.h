@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "callback_function.h"
+#include "stream_socket.h"
+#include "task.h"
+
+template<typename T> requires HasSetFdFunction<T>
+class ThreadManager;
+
+template<typename T> requires HasSetFdFunction<T>
+class CoConnection;
+
+// The handler of a connection in coroutine mode, it runs for the whole life of the connection,
+// which is closed when it returns
+template<typename T> requires HasSetFdFunction<T>
+using CoHandler = std::function<Task<>(CoConnection<T> &conn)>;
+
+// A connection as seen by a coroutine handler. The handler runs on the read thread of the connection:
+// the received data resumes it inline where the read callback would have been called, an await
+// allocates nothing and does not pass through a queue. Only the handler may use it
+template<typename T> requires HasSetFdFunction<T>
+class CoConnection {
+public:
+    CoConnection(ThreadManager<T> *manager, Connection *conn, T &t) : manager_(manager), conn_(conn), t_(t) {}
+
+    CoConnection(const CoConnection &) = delete;
+
+    CoConnection &operator=(const CoConnection &) = delete;
+
+    // The user object of the connection
+    inline T &Get() {
+        return t_;
+    }
+
+    inline bool Closed() const {
+        return closed_;
+    }
+
+    // The next message: a frame when the server has a codec, the data of one read otherwise.
+    // nullopt once the connection is closed and everything before was read
+    inline auto Read() {
+        return ReadAwaiter{this, false, 0};
+    }
+
+    // Exactly n bytes, taken across messages. nullopt when the connection closes before they arrive
+    inline auto ReadExactly(size_t n) {
+        return ReadAwaiter{this, true, n};
+    }
+
+    // Send the data. With watermarks set the handler waits while the unsent data is above
+    // the high watermark, until it drains to the low one. false when the connection is closed
+    inline auto Write(std::string &&data) {
+        return WriteAwaiter{this, std::move(data)};
+    }
+
+    // Close the connection, the reads after it return nullopt
+    void Close();
+
+    // Run the handler up to its first await
+    void Start(const CoHandler<T> &handler);
+
+    // Received data, resumes a waiting read
+    void OnMessage(std::string &&data);
+
+    // The unsent data fell to the low watermark, resumes a waiting write
+    void OnDrained();
+
+    // The connection was closed, resumes whatever waits
+    void OnClose();
+
+private:
+    struct ReadAwaiter {
+        CoConnection *conn;
+        bool exact;
+        size_t n;
+
+        bool await_ready() {
+            return conn->Ready(exact, n);
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            conn->reader_ = handle;
+            conn->exact_ = exact;
+            conn->want_ = n;
+        }
+
+        std::optional<std::string> await_resume() {
+            return conn->Take(exact, n);
+        }
+    };
+
+    struct WriteAwaiter {
+        CoConnection *conn;
+        std::string data;
+
+        // The data leaves right away, only the watermark may make the handler wait
+        bool await_ready() {
+            if (conn->closed_) {
+                return true;
+            }
+            conn->manager_->SendPacket(conn->t_, std::move(data));
+            return !static_cast<StreamSocket *>(conn->conn_->netEvent_.get())->AboveHighWatermark();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            conn->writer_ = handle;
+        }
+
+        bool await_resume() {
+            return !conn->closed_;
+        }
+    };
+
+    static Task<> Run(CoConnection *conn, const CoHandler<T> *handler);
+
+    // Whether a read can complete now, a closed connection completes every read
+    bool Ready(bool exact, size_t n) const;
+
+    // Take the message, or n bytes when exact
+    std::optional<std::string> Take(bool exact, size_t n);
+
+    // Resume the coroutine waiting in the handle, if any
+    static void Resume(std::coroutine_handle<> &handle);
+
+private:
+    ThreadManager<T> *manager_;
+    Connection *conn_;// the record outlives this object
+    T &t_;
+
+    Task<> root_;// the handler, destroyed with the connection also when it still waits
+
+    std::deque<std::string> input_;// received and not read yet
+    size_t head_ = 0;// bytes of the front message taken by ReadExactly
+    size_t buffered_ = 0;// unread bytes in input_
+
+    std::coroutine_handle<> reader_;// the handler waits in a read of want_ bytes, exact_ or a message
+    bool exact_ = false;
+    size_t want_ = 0;
+    std::coroutine_handle<> writer_;// the handler waits for the unsent data to drain
+
+    bool closed_ = false;
+};
+
+template<typename T>
+requires HasSetFdFunction<T>
+Task<> CoConnection<T>::Run(CoConnection *conn, const CoHandler<T> *handler) {
+    co_await (*handler)(*conn);
+    conn->Close();
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void CoConnection<T>::Start(const CoHandler<T> &handler) {
+    root_ = Run(this, &handler);
+    root_.Start();
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void CoConnection<T>::Close() {
+    if (!closed_) {
+        manager_->OnNetEventClose(conn_, "");
+    }
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void CoConnection<T>::OnMessage(std::string &&data) {
+    buffered_ += data.size();
+    input_.push_back(std::move(data));
+    if (reader_ && Ready(exact_, want_)) {
+        Resume(reader_);
+    }
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void CoConnection<T>::OnDrained() {
+    Resume(writer_);
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void CoConnection<T>::OnClose() {
+    closed_ = true;
+    Resume(reader_);
+    Resume(writer_);
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+bool CoConnection<T>::Ready(bool exact, size_t n) const {
+    if (closed_) {
+        return true;
+    }
+    return exact ? buffered_ >= n : !input_.empty();
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+std::optional<std::string> CoConnection<T>::Take(bool exact, size_t n) {
+    if (!exact) {
+        if (input_.empty()) {// closed
+            return std::nullopt;
+        }
+        auto msg = std::move(input_.front());
+        input_.pop_front();
+        if (head_ > 0) {
+            msg.erase(0, head_);
+            head_ = 0;
+        }
+        buffered_ -= msg.size();
+        return msg;
+    }
+
+    if (buffered_ < n) {// closed before the rest arrived
+        return std::nullopt;
+    }
+    if (head_ == 0 && !input_.empty() && input_.front().size() == n) {
+        auto msg = std::move(input_.front());
+        input_.pop_front();
+        buffered_ -= n;
+        return msg;
+    }
+    std::string data;
+    data.reserve(n);
+    while (data.size() < n) {
+        auto &front = input_.front();
+        size_t take = std::min(n - data.size(), front.size() - head_);
+        data.append(front, head_, take);
+        head_ += take;
+        if (head_ == front.size()) {
+            input_.pop_front();
+            head_ = 0;
+        }
+    }
+    buffered_ -= n;
+    return data;
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void CoConnection<T>::Resume(std::coroutine_handle<> &handle) {
+    if (handle) {
+        std::exchange(handle, nullptr).resume();
+    }
+}
@@ -0,0 +1,100 @@
+#include "codec.h"
+#include "net_event.h"
+
+int64_t LengthCodec::Decode(std::string_view data, size_t *, size_t *payloadPos, size_t *payloadSize) const {
+    if (data.size() < static_cast<size_t>(headerSize_)) {
+        return 0;
+    }
+    uint64_t length = 0;
+    for (int i = 0; i < headerSize_; ++i) {
+        length = (length << 8) | static_cast<uint8_t>(data[i]);
+    }
+    if (length > maxFrame_) {
+        return NE_ERROR;
+    }
+    if (data.size() - headerSize_ < length) {
+        return 0;
+    }
+    *payloadPos = headerSize_;
+    *payloadSize = length;
+    return static_cast<int64_t>(headerSize_ + length);
+}
+
+std::string LengthCodec::Encode(std::string_view payload) const {
+    std::string frame(headerSize_, '\0');
+    uint64_t length = payload.size();
+    for (int i = headerSize_ - 1; i >= 0; --i) {
+        frame[i] = static_cast<char>(length & 0xff);
+        length >>= 8;
+    }
+    frame.append(payload);
+    return frame;
+}
+
+int64_t VarintCodec::Decode(std::string_view data, size_t *, size_t *payloadPos, size_t *payloadSize) const {
+    constexpr size_t maxVarint = 10;
+    uint64_t length = 0;
+    size_t pos = 0;
+    while (true) {
+        if (pos == data.size()) {
+            return 0;
+        }
+        if (pos == maxVarint) {
+            return NE_ERROR;
+        }
+        auto byte = static_cast<uint8_t>(data[pos]);
+        length |= static_cast<uint64_t>(byte & 0x7f) << (7 * pos);
+        ++pos;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    if (length > maxFrame_) {
+        return NE_ERROR;
+    }
+    if (data.size() - pos < length) {
+        return 0;
+    }
+    *payloadPos = pos;
+    *payloadSize = length;
+    return static_cast<int64_t>(pos + length);
+}
+
+std::string VarintCodec::Encode(std::string_view payload) const {
+    std::string frame;
+    uint64_t length = payload.size();
+    do {
+        auto byte = static_cast<uint8_t>(length & 0x7f);
+        length >>= 7;
+        frame.push_back(static_cast<char>(length ? byte | 0x80 : byte));
+    } while (length);
+    frame.append(payload);
+    return frame;
+}
+
+int64_t DelimiterCodec::Decode(std::string_view data, size_t *scanned, size_t *payloadPos, size_t *payloadSize) const {
+    // A delimiter may start in the last bytes that were scanned
+    size_t from = *scanned >= delimiter_.size() ? *scanned - delimiter_.size() + 1 : 0;
+    auto pos = data.find(delimiter_, from);
+    if (pos == std::string_view::npos) {
+        if (data.size() > maxFrame_) {
+            return NE_ERROR;
+        }
+        *scanned = data.size();
+        return 0;
+    }
+    if (pos > maxFrame_) {
+        return NE_ERROR;
+    }
+    *payloadPos = 0;
+    *payloadSize = pos;
+    return static_cast<int64_t>(pos + delimiter_.size());
+}
+
+std::string DelimiterCodec::Encode(std::string_view payload) const {
+    std::string frame;
+    frame.reserve(payload.size() + delimiter_.size());
+    frame.append(payload);
+    frame.append(delimiter_);
+    return frame;
+}
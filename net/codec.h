@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Splits the received byte stream of a connection into frames.
+// A codec holds no per connection state and may be shared by all connections
+class Codec {
+public:
+    virtual ~Codec() = default;
+
+    // Find the first frame of data. Return the bytes it takes including its header or delimiter
+    // and set the position and size of its payload in data. Return 0 when the frame is not complete,
+    // the next call gets the same data with more appended, or NE_ERROR when the data is malformed.
+    // The first *scanned bytes are known not to complete a frame, a codec that searches may skip
+    // them and store how far it got when it returns 0
+    virtual int64_t Decode(std::string_view data, size_t *scanned, size_t *payloadPos, size_t *payloadSize) const = 0;
+
+    // Frame the payload for sending
+    virtual std::string Encode(std::string_view payload) const = 0;
+
+protected:
+    static constexpr size_t defaultMaxFrame_ = 64 * 1024 * 1024;
+};
+
+// Frames with a fixed size big-endian length header of 1 to 8 bytes,
+// the length counts the payload only
+class LengthCodec : public Codec {
+public:
+    explicit LengthCodec(int headerSize = 4, size_t maxFrame = defaultMaxFrame_)
+            : headerSize_(headerSize < 1 ? 1 : (headerSize > 8 ? 8 : headerSize)), maxFrame_(maxFrame) {}
+
+    int64_t Decode(std::string_view data, size_t *scanned, size_t *payloadPos, size_t *payloadSize) const override;
+
+    std::string Encode(std::string_view payload) const override;
+
+private:
+    const int headerSize_ = 4;
+    const size_t maxFrame_ = defaultMaxFrame_;
+};
+
+// Frames with a base 128 varint length header, as used by protobuf streams
+class VarintCodec : public Codec {
+public:
+    explicit VarintCodec(size_t maxFrame = defaultMaxFrame_) : maxFrame_(maxFrame) {}
+
+    int64_t Decode(std::string_view data, size_t *scanned, size_t *payloadPos, size_t *payloadSize) const override;
+
+    std::string Encode(std::string_view payload) const override;
+
+private:
+    const size_t maxFrame_ = defaultMaxFrame_;
+};
+
+// Frames that end with a delimiter, "\n" by default. The delimiter is not part of the payload
+class DelimiterCodec : public Codec {
+public:
+    explicit DelimiterCodec(std::string delimiter = "\n", size_t maxFrame = defaultMaxFrame_)
+            : delimiter_(delimiter.empty() ? "\n" : std::move(delimiter)), maxFrame_(maxFrame) {}
+
+    int64_t Decode(std::string_view data, size_t *scanned, size_t *payloadPos, size_t *payloadSize) const override;
+
+    std::string Encode(std::string_view payload) const override;
+
+private:
+    const std::string delimiter_;
+    const size_t maxFrame_ = defaultMaxFrame_;
+};
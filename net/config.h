@@ -12,3 +12,35 @@
 #ifdef __linux__
 #define HAVE_ACCEPT4 1
 #endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+
+#ifdef __linux__
+#define HAVE_EVENTFD 1
+#endif
+
+#ifdef __linux__
+#define HAVE_SCHED_AFFINITY 1
+#endif
+
+#ifdef __linux__
+#define HAVE_REUSEPORT_CBPF 1
+#endif
+
+#ifdef __linux__
+#define HAVE_SENDMMSG 1
+#endif
+
+#ifdef __linux__
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+
+#ifdef __linux__
+#define HAVE_SENDFILE 1
+#endif
+
+#ifdef __linux__
+#define HAVE_BUSY_POLL 1
+#endif
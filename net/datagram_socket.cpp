@@ -0,0 +1,266 @@
+#include <netinet/udp.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+#include "datagram_socket.h"
+
+static constexpr socklen_t udpBuffSize = 4 * 1024 * 1024;// bursts of small datagrams need a deep queue
+
+// Count an IO syscall for the loop of the calling thread
+static void CountIo(LoopCounter LoopStats::*calls, LoopCounter LoopStats::*bytes, uint64_t n) {
+    if (auto stats = LoopStats::Current()) {
+        (stats->*calls).Add(1);
+        (stats->*bytes).Add(n);
+    }
+}
+
+int DatagramSocket::Init() {
+    if (Fd() != 0 || addr_.Empty()) {
+        return static_cast<int>(NetListen::OPEN_ERROR);
+    }
+    fd_ = CreateUDPSocket(addr_.Family());
+    if (Fd() < 0) {
+        return static_cast<int>(NetListen::OPEN_ERROR);
+    }
+    SetNonBlock(true);
+    SetReuseAddr();
+    SetReusePort();
+    SetRcvBuf(udpBuffSize);
+    SetSndBuf(udpBuffSize);
+
+#if defined(HAVE_SENDMMSG) && defined(UDP_GRO)
+    int on = 1;
+    gro_ = ::setsockopt(Fd(), SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+#endif
+#if defined(HAVE_SENDMMSG) && defined(UDP_SEGMENT)
+    // The size is set per message, the socket option only tells whether the kernel knows it
+    int segment = 0;
+    gso_ = ::setsockopt(Fd(), SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+#endif
+
+    if (::bind(Fd(), addr_.Data(), addr_.Length()) != 0) {
+        Close();
+        return static_cast<int>(NetListen::BIND_ERROR);
+    }
+    return static_cast<int>(NetListen::OK);
+}
+
+void DatagramSocket::SetupReceive() {
+    recvBuffers_ = std::make_unique<char[]>(batchSize_ * slotSize_);
+#ifdef HAVE_SENDMMSG
+    recvMsgs_.resize(batchSize_);
+    recvIov_.resize(batchSize_);
+    recvAddrs_.resize(batchSize_);
+    recvControl_.resize(batchSize_ * CMSG_SPACE(sizeof(int)));
+#endif
+}
+
+int DatagramSocket::OnReadable(const std::shared_ptr<Connection> &, std::string *) {
+    if (!recvBuffers_) {
+        SetupReceive();
+    }
+#ifdef HAVE_SENDMMSG
+    const size_t controlSize = CMSG_SPACE(sizeof(int));
+    for (int batch = 0; batch < readBatches_; ++batch) {
+        for (int i = 0; i < batchSize_; ++i) {
+            recvIov_[i] = {recvBuffers_.get() + i * slotSize_, slotSize_};
+            auto &hdr = recvMsgs_[i].msg_hdr;
+            hdr = {};
+            hdr.msg_name = &recvAddrs_[i];
+            hdr.msg_namelen = sizeof(sockaddr_storage);
+            hdr.msg_iov = &recvIov_[i];
+            hdr.msg_iovlen = 1;
+            if (gro_) {
+                hdr.msg_control = recvControl_.data() + i * controlSize;
+                hdr.msg_controllen = controlSize;
+            }
+        }
+        int n = ::recvmmsg(Fd(), recvMsgs_.data(), batchSize_, MSG_DONTWAIT, nullptr);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN, or an error of an earlier datagram that does not concern the next ones
+            break;
+        }
+        uint64_t bytes = 0;
+        for (int i = 0; i < n; ++i) {
+            bytes += recvMsgs_[i].msg_len;
+        }
+        CountIo(&LoopStats::reads, &LoopStats::bytesRead, bytes);
+
+        for (int i = 0; i < n; ++i) {
+            size_t size = recvMsgs_[i].msg_len;
+            size_t segment = size;
+#ifdef UDP_GRO
+            auto &hdr = recvMsgs_[i].msg_hdr;
+            for (auto cmsg = CMSG_FIRSTHDR(&hdr); gro_ && cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    int gsoSize;
+                    memcpy(&gsoSize, CMSG_DATA(cmsg), sizeof(gsoSize));
+                    segment = gsoSize > 0 ? gsoSize : size;
+                }
+            }
+#endif
+            Deliver(recvBuffers_.get() + i * slotSize_, size, segment,
+                    SocketAddr(reinterpret_cast<const sockaddr *>(&recvAddrs_[i]), recvMsgs_[i].msg_hdr.msg_namelen));
+        }
+        if (n < batchSize_) {// drained
+            break;
+        }
+    }
+#else
+    for (int i = 0; i < readBatches_ * batchSize_; ++i) {
+        sockaddr_storage peer{};
+        socklen_t peerLength = sizeof(peer);
+        auto n = ::recvfrom(Fd(), recvBuffers_.get(), slotSize_, 0, reinterpret_cast<sockaddr *>(&peer),
+                            &peerLength);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        CountIo(&LoopStats::reads, &LoopStats::bytesRead, n);
+        Deliver(recvBuffers_.get(), n, n, SocketAddr(reinterpret_cast<const sockaddr *>(&peer), peerLength));
+    }
+#endif
+    return NE_OK;
+}
+
+void DatagramSocket::Deliver(const char *data, size_t size, size_t segment, const SocketAddr &peer) {
+    if (size == 0) {// an empty datagram is a datagram as well
+        onDatagram_(std::string(), peer);
+        return;
+    }
+    for (size_t pos = 0; pos < size; pos += segment) {
+        onDatagram_(std::string(data + pos, std::min(segment, size - pos)), peer);
+    }
+}
+
+bool DatagramSocket::SendTo(const SocketAddr &peer, std::string &&msg) {
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    bool idle = sendQueue_.empty();
+    sendQueue_.push_back({peer, std::move(msg)});
+    return idle;
+}
+
+bool DatagramSocket::SendPacket(std::string &&) {
+    return false;
+}
+
+int DatagramSocket::OnWritable() {
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    while (!sendQueue_.empty()) {
+        int sent = SendBatch();
+        if (sent >= 0) {
+            PopSent(sent);
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {// wait for write readiness
+            break;
+        }
+        if (gso_ && (errno == EIO || errno == EINVAL)) {// no GSO on the route or the device, send them one by one
+            gso_ = false;
+            continue;
+        }
+        // The first datagram cannot be sent to its peer, drop it like the network would
+        PopSent(1);
+    }
+    return static_cast<int>(std::min<size_t>(sendQueue_.size(), INT_MAX));
+}
+
+int DatagramSocket::SendBatch() {
+#ifdef HAVE_SENDMMSG
+    if (sendMsgs_.empty()) {
+        sendMsgs_.resize(batchSize_);
+        sendIov_.resize(batchSize_ * maxSegments_);
+        sendControl_.resize(batchSize_ * CMSG_SPACE(sizeof(uint16_t)));
+        sendCounts_.resize(batchSize_);
+    }
+    const size_t controlSize = CMSG_SPACE(sizeof(uint16_t));
+    size_t next = 0;
+    int messages = 0;
+    while (messages < batchSize_ && next < sendQueue_.size()) {
+        auto &first = sendQueue_[next];
+        auto iov = &sendIov_[messages * maxSegments_];
+        iov[0] = {first.data.data(), first.data.size()};
+        size_t count = 1;
+        size_t total = first.data.size();
+        size_t segment = first.data.size();
+#ifdef UDP_SEGMENT
+        // Consecutive datagrams of the segment size to the same peer, the last one may be shorter
+        while (gso_ && segment > 0 && count < maxSegments_ && next + count < sendQueue_.size()) {
+            auto &item = sendQueue_[next + count];
+            if (item.peer != first.peer || item.data.empty() || item.data.size() > segment ||
+                total + item.data.size() > maxGsoSize_) {
+                break;
+            }
+            iov[count] = {item.data.data(), item.data.size()};
+            total += item.data.size();
+            ++count;
+            if (item.data.size() < segment) {
+                break;
+            }
+        }
+#endif
+        auto &hdr = sendMsgs_[messages].msg_hdr;
+        hdr = {};
+        hdr.msg_name = const_cast<sockaddr *>(first.peer.Data());
+        hdr.msg_namelen = first.peer.Length();
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = count;
+#ifdef UDP_SEGMENT
+        if (count > 1) {
+            hdr.msg_control = sendControl_.data() + messages * controlSize;
+            hdr.msg_controllen = controlSize;
+            auto cmsg = CMSG_FIRSTHDR(&hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            auto size = static_cast<uint16_t>(segment);
+            memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+        }
+#endif
+        sendCounts_[messages] = count;
+        next += count;
+        ++messages;
+    }
+
+    int n = ::sendmmsg(Fd(), sendMsgs_.data(), messages, MSG_DONTWAIT);
+    if (n < 0) {
+        return -1;
+    }
+    size_t datagrams = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; ++i) {
+        datagrams += sendCounts_[i];
+        bytes += sendMsgs_[i].msg_len;
+    }
+    CountIo(&LoopStats::writes, &LoopStats::bytesWritten, bytes);
+    return static_cast<int>(datagrams);
+#else
+    auto &item = sendQueue_.front();
+    auto n = ::sendto(Fd(), item.data.data(), item.data.size(), 0, item.peer.Data(), item.peer.Length());
+    if (n < 0) {
+        return -1;
+    }
+    CountIo(&LoopStats::writes, &LoopStats::bytesWritten, n);
+    return 1;
+#endif
+}
+
+void DatagramSocket::PopSent(size_t count) {
+    count = std::min(count, sendQueue_.size());
+    sendQueue_.erase(sendQueue_.begin(), sendQueue_.begin() + static_cast<std::ptrdiff_t>(count));
+}
+
+void DatagramSocket::OnError() {
+    int err = 0;
+    socklen_t length = sizeof(err);
+    ::getsockopt(Fd(), SOL_SOCKET, SO_ERROR, &err, &length);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "base_socket.h"
+
+// Called for every received datagram with the address of its sender
+using OnDatagram = std::function<void(std::string &&msg, const SocketAddr &peer)>;
+
+// A UDP socket bound to the server address, each thread owns one of the SO_REUSEPORT group.
+// Reads drain the socket in batches through recvmmsg and hand every datagram to the callback.
+// Sends are queued from any thread and written in batches through sendmmsg by the owning loop.
+// Where the kernel supports it, UDP GRO delivers several datagrams of one sender in one buffer
+// and UDP GSO sends consecutive datagrams of the same size to the same peer in one message
+class DatagramSocket : public BaseSocket {
+
+public:
+    explicit DatagramSocket(const SocketAddr &addr) : BaseSocket(0), addr_(addr) {
+        SetSocketType(SOCKET_UDP);
+    }
+
+    // Open the socket, join the SO_REUSEPORT group of the address and bind it
+    int Init() override;
+
+    // Deliver the waiting datagrams, at most readBatches_ batches per call
+    int OnReadable(const std::shared_ptr<Connection> &conn, std::string *readBuff) override;
+
+    // Send the queued datagrams. Return NE_ERROR or the number of datagrams still queued
+    int OnWritable() override;
+
+    // A datagram needs a peer, use SendTo
+    bool SendPacket(std::string &&msg) override;
+
+    // Clear the pending error of the socket, a failed datagram does not end it
+    void OnError() override;
+
+    // Queue a datagram, from any thread. Return true when the queue was empty before,
+    // the owning loop has to be told to flush it then
+    bool SendTo(const SocketAddr &peer, std::string &&msg);
+
+    inline void SetOnDatagram(const OnDatagram &onDatagram) {
+        onDatagram_ = onDatagram;
+    }
+
+private:
+    struct Outgoing {
+        SocketAddr peer;
+        std::string data;
+    };
+
+    // Allocate the receive batch on the first read
+    void SetupReceive();
+
+    // Hand the datagrams of one received buffer to the callback, a GRO buffer holds several of segment bytes
+    void Deliver(const char *data, size_t size, size_t segment, const SocketAddr &peer);
+
+    // Pop the datagrams that were sent, sendMutex_ must be held
+    void PopSent(size_t count);
+
+    // Send a batch from the front of the queue, sendMutex_ must be held.
+    // Return the number of datagrams that left, or -1 with errno set
+    int SendBatch();
+
+private:
+    static constexpr int batchSize_ = 32;// messages per recvmmsg/sendmmsg
+    static constexpr int maxSegments_ = 64;// datagrams per GSO message, the kernel limit
+    static constexpr size_t slotSize_ = 64 * 1024;// a GRO buffer takes up to 64KB
+    static constexpr size_t maxGsoSize_ = 65000;// bytes per GSO message, below the IP limit
+    const int readBatches_ = 8;// per readiness, the level-triggered poll reports the rest
+
+    SocketAddr addr_;
+
+    OnDatagram onDatagram_;
+
+    bool gro_ = false;// the kernel coalesces received datagrams
+    bool gso_ = false;// the kernel splits sent messages
+
+    // receive batch, only touched by the owning loop
+    std::unique_ptr<char[]> recvBuffers_;
+#ifdef HAVE_SENDMMSG
+    std::vector<mmsghdr> recvMsgs_;
+    std::vector<iovec> recvIov_;
+    std::vector<sockaddr_storage> recvAddrs_;
+    std::vector<char> recvControl_;
+
+    // send batch
+    std::vector<mmsghdr> sendMsgs_;
+    std::vector<iovec> sendIov_;
+    std::vector<char> sendControl_;
+    std::vector<size_t> sendCounts_;// datagrams in each message
+#endif
+
+    std::mutex sendMutex_;
+    std::deque<Outgoing> sendQueue_;
+};
@@ -0,0 +1,72 @@
+#include "epoch.h"
+
+namespace {
+
+// One record per thread, records of exited threads are reused by new ones
+struct alignas(64) Record {
+    std::atomic<uint64_t> pinned = 0;// 0 means not pinned
+    std::atomic<bool> used = true;
+    Record *next = nullptr;
+    int depth = 0;// only touched by the owner thread
+};
+
+std::atomic<uint64_t> globalEpoch = 1;
+
+std::atomic<Record *> records = nullptr;
+
+Record *AcquireRecord() {
+    for (auto record = records.load(std::memory_order_acquire); record; record = record->next) {
+        bool expected = false;
+        if (!record->used.load(std::memory_order_relaxed) && record->used.compare_exchange_strong(expected, true)) {
+            return record;
+        }
+    }
+    auto record = new Record;
+    auto head = records.load(std::memory_order_relaxed);
+    do {
+        record->next = head;
+    } while (!records.compare_exchange_weak(head, record, std::memory_order_release, std::memory_order_relaxed));
+    return record;
+}
+
+struct RecordOwner {
+    Record *record = AcquireRecord();
+
+    ~RecordOwner() {
+        record->used.store(false, std::memory_order_release);
+    }
+};
+
+thread_local RecordOwner owner;
+
+}
+
+Epoch::Guard::Guard() {
+    auto record = owner.record;
+    if (record->depth++ == 0) {
+        // seq_cst orders the pin before the loads of the slots it protects
+        record->pinned.store(globalEpoch.load(), std::memory_order_seq_cst);
+    }
+}
+
+Epoch::Guard::~Guard() {
+    auto record = owner.record;
+    if (--record->depth == 0) {
+        record->pinned.store(0, std::memory_order_release);
+    }
+}
+
+uint64_t Epoch::Advance() {
+    return globalEpoch.fetch_add(1) + 1;
+}
+
+uint64_t Epoch::Oldest() {
+    uint64_t oldest = UINT64_MAX;
+    for (auto record = records.load(std::memory_order_acquire); record; record = record->next) {
+        auto pinned = record->pinned.load();
+        if (pinned != 0 && pinned < oldest) {
+            oldest = pinned;
+        }
+    }
+    return oldest;
+}
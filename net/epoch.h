@@ -0,0 +1,30 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Epoch based protection for objects that threads outside the event loops reach
+// through a shared pointer slot. A reader pins the current epoch while it uses
+// what it loaded from the slot. A writer unlinks the object, starts a new epoch
+// with Advance() and frees the object once Oldest() has caught up with that epoch
+class Epoch {
+public:
+    // Pin the current epoch for the lifetime of the guard, guards may nest.
+    // Pinning is two stores on a thread local record and never waits
+    class Guard {
+    public:
+        Guard();
+
+        ~Guard();
+
+        Guard(const Guard &) = delete;
+
+        Guard &operator=(const Guard &) = delete;
+    };
+
+    // Start a new epoch after an object was unlinked, returns the epoch readers must reach
+    static uint64_t Advance();
+
+    // The oldest epoch pinned by any thread, UINT64_MAX when no thread is pinned
+    static uint64_t Oldest();
+};
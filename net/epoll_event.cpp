@@ -4,6 +4,8 @@
 #ifdef HAVE_EPOLL
 
 #include "callback_function.h"
+#include "listen_socket.h"
+#include "stream_socket.h"
 
 const int BaseEvent::EVENT_READ = EPOLLIN;
 const int BaseEvent::EVENT_WRITE = EPOLLOUT;
@@ -15,27 +17,50 @@ bool EpollEvent::Init() {
     if (fd_ == -1) {// If the epoll creation fails, return false
         return false;
     }
-    if (mode_ & EVENT_MODE_READ) {// Add the listen socket to epoll for read
-        AddEvent(listen_->Fd(), EVENT_READ | EVENT_ERROR | EVENT_HUB);
+    // The listen socket and the wakeup fd stay level-triggered in every mode.
+    // Their epoll data is the listen socket and nullptr, every other fd carries its Connection
+    for (auto &listen: listens_) {// Add the listen sockets to epoll for read, a UDP loop has none
+        if (!(mode_ & EVENT_MODE_READ)) {
+            break;
+        }
+        uint32_t events = EVENT_READ | EVENT_ERROR | EVENT_HUB;
+        // One socket in every thread, a new connection wakes only one of them
+        if (!static_cast<ListenSocket *>(listen.get())->ReusePort()) {
+            events |= EPOLLEXCLUSIVE;
+        }
+        CtlEvent(EPOLL_CTL_ADD, listen->Fd(), events, listen.get());
+    }
+    if (!OpenWakeup()) {
+        return false;
     }
-    pipe(pipeFd);
-    AddEvent(pipeFd[0], EVENT_READ | EVENT_ERROR | EVENT_HUB);
+    CtlEvent(EPOLL_CTL_ADD, wakeupFd_[0], EVENT_READ | EVENT_ERROR | EVENT_HUB, nullptr);
 
     return true;
 }
 
-void EpollEvent::AddEvent(int fd, int mask) {
-    struct epoll_event ev{};
-    ev.events = mask;
-    ev.data.fd = fd;
-    epoll_ctl(Fd(), EPOLL_CTL_ADD, fd, &ev);
+void EpollEvent::AddEvent(Connection *conn, int mask) {
+    uint32_t events = mask;
+    if (mode_ & EVENT_MODE_EDGE) {
+        // Register once for everything this multiplex handles,
+        // the interest is only modified to pause reading
+        events |= EPOLLET;
+        if (mask & EVENT_READ) {
+            events |= EPOLLRDHUP;
+        }
+        if (mode_ & EVENT_MODE_WRITE) {
+            events |= EVENT_WRITE;
+        }
+    }
+    CtlEvent(EPOLL_CTL_ADD, conn->fd_, events, conn);
 }
 
 void EpollEvent::DelEvent(int fd) {
+    stats_.ctls.Add(1);
     epoll_ctl(Fd(), EPOLL_CTL_DEL, fd, nullptr);
 }
 
 void EpollEvent::EventPoll() {
+    StartLoop();
     if (mode_ & EVENT_MODE_READ) {// If it is a read multiplex, call EventRead
         EventRead();
     } else {// If it is a write multiplex, call EventWrite
@@ -43,121 +68,218 @@ void EpollEvent::EventPoll() {
     }
 }
 
-void EpollEvent::AddWriteEvent(int fd) {
+void EpollEvent::AddWriteEvent(Connection *conn) {
+    if (mode_ & EVENT_MODE_EDGE) {// write readiness is tracked by the socket
+        return;
+    }
     if (mode_ & EVENT_MODE_READ) {// If it is a read multiplex, modify the event
-        struct epoll_event ev{};
-        ev.events = EVENT_WRITE;
-        ev.data.fd = fd;
-        epoll_ctl(Fd(), EPOLL_CTL_MOD, fd, &ev);
+        if (conn->writeArmed_) {
+            return;
+        }
+        conn->writeArmed_ = true;
+        CtlEvent(EPOLL_CTL_MOD, conn->fd_, Interest(conn), conn);
     } else {// If it is a write multiplex, add the event
-        struct epoll_event ev{};
-        ev.events = EVENT_WRITE;
-        ev.data.fd = fd;
-        epoll_ctl(Fd(), EPOLL_CTL_ADD, fd, &ev);
+        CtlEvent(EPOLL_CTL_ADD, conn->fd_, EVENT_WRITE, conn);
     }
 }
 
-void EpollEvent::DelWriteEvent(int fd) {
+void EpollEvent::DelWriteEvent(Connection *conn) {
+    if (mode_ & EVENT_MODE_EDGE) {
+        return;
+    }
     if (mode_ & EVENT_MODE_READ) {// If it is a read multiplex, modify the event to read
-        struct epoll_event ev{};
-        ev.events = EVENT_READ;
-        ev.data.fd = fd;
-        epoll_ctl(Fd(), EPOLL_CTL_MOD, fd, &ev);
+        conn->writeArmed_ = false;
+        CtlEvent(EPOLL_CTL_MOD, conn->fd_, Interest(conn), conn);
     } else {
-        struct epoll_event ev{};
-        ev.data.fd = fd;
-        epoll_ctl(Fd(), EPOLL_CTL_DEL, fd, &ev);
+        DelEvent(conn->fd_);
+    }
+}
+
+void EpollEvent::SetReadEnabled(Connection *conn, bool enabled) {
+    if (conn->readPaused_ == !enabled) {
+        return;
     }
+    conn->readPaused_ = !enabled;
+    // A paused edge-triggered connection gets a new edge on re-arm if data is waiting
+    CtlEvent(EPOLL_CTL_MOD, conn->fd_, Interest(conn), conn);
+}
+
+void EpollEvent::AddConnectEvent(Connection *conn) {
+    conn->connecting_ = true;
+    CtlEvent(EPOLL_CTL_ADD, conn->fd_, EVENT_WRITE | EVENT_ERROR | EVENT_HUB, conn);
 }
 
 void EpollEvent::EventRead() {
     struct epoll_event events[eventsSize];
     while (running_) {
-        int nfds = epoll_wait(Fd(), events, eventsSize, -1);
+        int nfds = epoll_wait(Fd(), events, eventsSize, PollTimeout());
+        CountPoll(nfds);
         for (int i = 0; i < nfds; ++i) {
-            if ((events[i].events & EVENT_HUB) || (events[i].events & EVENT_ERROR)) {
+            if (auto listen = FindListen(events[i].data.ptr)) {// A new connection
+                DoAccept(static_cast<ListenSocket *>(listen));
+                continue;
+            }
+            auto conn = static_cast<Connection *>(events[i].data.ptr);
+            if (!conn) {// Woken up, maybe with messages from other threads
+                DrainWakeup();
+                DrainMailbox();
+                continue;
+            }
+            if (conn->closed_) {// Closed earlier in this round or by another thread
+                continue;
+            }
+            if (conn->connecting_) {// A failed connect reports an error, the connection checks it
+                DoConnect(conn);
+                continue;
+            }
+
+            auto revents = events[i].events;
+            if ((revents & EVENT_ERROR) && conn->zeroCopy_ && DoErrorQueue(conn)) {
+                revents &= ~EVENT_ERROR;// only completions of zero-copy sends
+            }
+            if ((revents & EVENT_HUB) || (revents & EVENT_ERROR)) {
                 // If the event is an error event, call DoError
-                DoError(events[i], "");
+                DoError(conn, "");
                 continue;
             }
-            std::shared_ptr<Connection> conn;
-            if (events[i].events & EVENT_READ) {
-                // If the event is less than the listen socket, it is a new connection
-                if (events[i].data.fd != listen_->Fd()) {
-                    conn = getConn_(events[i].data.fd);
-                }
-                DoRead(events[i], conn);
+            if (revents & EVENT_READ) {
+                DoRead(conn);
             }
 
-            if ((mode_ & EVENT_MODE_WRITE) && events[i].events & EVENT_WRITE) {
-                conn = getConn_(events[i].data.fd);
-                if (!conn) {// If the connection is empty, call DoError
-                    DoError(events[i], "connection is null");
-                    continue;
-                }
+            if ((mode_ & EVENT_MODE_WRITE) && (revents & EVENT_WRITE) && !conn->closed_) {
                 // If the event is a write event, call DoWrite
-                DoWrite(events[i], conn);
+                DoWrite(conn);
+            }
+
+            if ((revents & EPOLLRDHUP) && OnEndOfStream(conn)) {
+                // Edge-triggered mode: the peer shut down its side, the data before the FIN has been read above
+                DoError(conn, "");
             }
         }
+        EndRound();
     }
 }
 
 void EpollEvent::EventWrite() {
     struct epoll_event events[eventsSize];
     while (running_) {
-        int nfds = epoll_wait(Fd(), events, eventsSize, -1);
+        int nfds = epoll_wait(Fd(), events, eventsSize, PollTimeout());
+        CountPoll(nfds);
         for (int i = 0; i < nfds; ++i) {
-            if ((events[i].events & EVENT_HUB) || (events[i].events & EVENT_ERROR)) {
-                DoError(events[i], "");
-            }
-            auto conn = getConn_(events[i].data.fd);
+            auto conn = static_cast<Connection *>(events[i].data.ptr);
             if (!conn) {
-                DoError(events[i], "connection is null");
+                DrainWakeup();
+                DrainMailbox();
+                continue;
+            }
+            if (conn->closed_) {
+                continue;
+            }
+            auto revents = events[i].events;
+            if ((revents & EVENT_ERROR) && conn->zeroCopy_ && DoErrorQueue(conn)) {
+                revents &= ~EVENT_ERROR;
+            }
+            if ((revents & EVENT_HUB) || (revents & EVENT_ERROR)) {
+                DoError(conn, "");
                 continue;
             }
-            if (events[i].events & EVENT_WRITE) {
-                DoWrite(events[i], conn);
+            if (revents & EVENT_WRITE) {
+                DoWrite(conn);
             }
         }
+        EndRound();
     }
 }
 
-void EpollEvent::DoRead(const epoll_event &event, const std::shared_ptr<Connection> &conn) {
-    if (event.data.fd == listen_->Fd()) {
-        auto newConn = std::make_shared<Connection>(shared_from_this(), nullptr);
-        auto connFd = listen_->OnReadable(newConn, nullptr);
-        if (connFd < 0) {
-            DoError(event, "accept error");
+void EpollEvent::DoAccept(ListenSocket *listen) {
+    for (int i = 0; i < acceptBudget; ++i) {
+        auto fd = listen->Accept();
+        if (fd < 0) {// drained, or an error that the next event retries
             return;
         }
-        onCreate_(connFd, newConn);
-    } else if (conn) {
-        std::string readBuff;
-        int ret = conn->netEvent_->OnReadable(conn, &readBuff);
-        if (ret == NE_ERROR) {
-            DoError(event, "read error");
-            return;
+        stats_.accepts.Add(1);
+        auto newConn = Connection::Create(shared_from_this());
+        auto connFd = listen->OnAccepted(newConn, fd);
+        if (mode_ & EVENT_MODE_EDGE) {
+            static_cast<StreamSocket *>(newConn->netEvent_.get())->SetEdgeTrigger();
         }
-        onMessage_(event.data.fd, std::move(readBuff));
-    } else {
-        DoError(event, "connection is null");
+        onCreate_(connFd, newConn);
+    }
+}
+
+void EpollEvent::DoRead(Connection *conn) {
+    std::string readBuff = std::move(conn->readBuff_);// the partial frame of the last read, if any
+    int ret = conn->netEvent_->OnReadable(nullptr, &readBuff);
+    if (ret == NE_ERROR) {
+        DoError(conn, "read error");
+        return;
+    }
+    bool peerClosed = conn->netEvent_->PeerClosed();
+    if (!peerClosed || !readBuff.empty()) {
+        onMessage_(conn, std::move(readBuff));
+    }
+    if (peerClosed && OnEndOfStream(conn)) {
+        DoError(conn, "");
     }
 }
 
-void EpollEvent::DoWrite(const epoll_event &event, const std::shared_ptr<Connection> &conn) {
+void EpollEvent::DoWrite(Connection *conn) {
     auto ret = conn->netEvent_->OnWritable();
     if (ret == NE_ERROR) {
-        DoError(event, "write error");
+        DoError(conn, "write error");
         return;
     }
     if (ret == 0) {
-        DelWriteEvent(event.data.fd);
+        if (Drained(conn)) {// the last answer to a peer that has finished
+            DoError(conn, "");
+            return;
+        }
+        DelWriteEvent(conn);
+    }
+}
+
+void EpollEvent::DoConnect(Connection *conn) {
+    // Registered again for everything the connection needs once it is created
+    conn->connecting_ = false;
+    DelEvent(conn->fd_);
+    onConnect_(conn);
+}
+
+bool EpollEvent::DoErrorQueue(Connection *conn) {
+    return static_cast<StreamSocket *>(conn->netEvent_.get())->OnErrorQueue() == NE_OK;
+}
+
+void EpollEvent::DoError(Connection *conn, std::string &&err) {
+    // Closing the socket removes it from every epoll, another thread may have
+    // closed it already and the fd number may belong to a new connection by now
+    onClose_(conn, std::move(err));
+}
+
+uint32_t EpollEvent::Interest(const Connection *conn) const {
+    uint32_t events = EVENT_ERROR | EVENT_HUB;
+    if (!conn->readPaused_) {// the peer close is noticed once the data before it is read
+        events |= EVENT_READ;
+        if (mode_ & EVENT_MODE_EDGE) {
+            events |= EPOLLRDHUP;
+        }
+    }
+    if (mode_ & EVENT_MODE_EDGE) {
+        events |= EPOLLET;
+        if (mode_ & EVENT_MODE_WRITE) {
+            events |= EVENT_WRITE;
+        }
+    } else if (conn->writeArmed_) {
+        events |= EVENT_WRITE;
     }
+    return events;
 }
 
-void EpollEvent::DoError(const epoll_event &event, std::string &&err) {
-    DelEvent(event.data.fd);
-    onClose_(event.data.fd, std::move(err));
+void EpollEvent::CtlEvent(int op, int fd, uint32_t events, void *ptr) {
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.ptr = ptr;
+    stats_.ctls.Add(1);
+    epoll_ctl(Fd(), op, fd, &ev);
 }
 
-#endif
\ No newline at end of file
+#endif
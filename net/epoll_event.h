@@ -11,12 +11,14 @@
 
 #include "base_event.h"
 
+class ListenSocket;
+
 
 class EpollEvent : public BaseEvent {
 
 public:
-    explicit EpollEvent(const std::shared_ptr<NetEvent> &listen, int8_t mode) : BaseEvent(listen, mode,
-                                                                                          BaseEvent::EVENT_TYPE_EPOLL) {
+    explicit EpollEvent(const ListenSockets &listens, int8_t mode) : BaseEvent(listens, mode,
+                                                                               BaseEvent::EVENT_TYPE_EPOLL) {
     };
 
     ~EpollEvent() override {
@@ -27,7 +29,7 @@ public:
     bool Init() override;
 
     // Add event to epoll, mask is the event type
-    void AddEvent(int fd, int mask) override;
+    void AddEvent(Connection *conn, int mask) override;
 
     // Delete event from epoll
     void DelEvent(int fd) override;
@@ -36,10 +38,16 @@ public:
     void EventPoll() override;
 
     // Add write event to epoll
-    void AddWriteEvent(int fd) override;
+    void AddWriteEvent(Connection *conn) override;
 
     // Delete write event from epoll
-    void DelWriteEvent(int fd) override;
+    void DelWriteEvent(Connection *conn) override;
+
+    // Drop or restore the read interest
+    void SetReadEnabled(Connection *conn, bool enabled) override;
+
+    // Wait for write readiness, which reports the end of the connect
+    void AddConnectEvent(Connection *conn) override;
 
     // Handle read event
     void EventRead();
@@ -47,17 +55,37 @@ public:
     // Handle write event
     void EventWrite();
 
+    // Accept the pending connections of the listen socket, at most acceptBudget per event
+    void DoAccept(ListenSocket *listen);
+
     // Do read event
-    void DoRead(const epoll_event &event, const std::shared_ptr<Connection> &conn);
+    void DoRead(Connection *conn);
 
     // Do write event
-    void DoWrite(const epoll_event &event, const std::shared_ptr<Connection> &conn);
+    void DoWrite(Connection *conn);
+
+    // The connect finished, hand the connection back without its interest
+    void DoConnect(Connection *conn);
+
+    // EPOLLERR of a zero-copy connection, the error queue may only hold send completions.
+    // Return true when it did and the socket has no error
+    bool DoErrorQueue(Connection *conn);
 
     // Handle error event
-    void DoError(const epoll_event &event, std::string &&err);
+    void DoError(Connection *conn, std::string &&err);
 
 private:
+    // epoll_ctl wrapper, ptr is stored as the epoll data
+    void CtlEvent(int op, int fd, uint32_t events, void *ptr);
+
+    // Events a connection of this multiplex is registered for
+    uint32_t Interest(const Connection *conn) const;
+
     const int eventsSize = 1024;
+
+    // A storm of connections must not starve the events of the established ones,
+    // the level-triggered listen socket reports the rest in the next round
+    const int acceptBudget = 64;
 };
 
 #endif
@@ -1,8 +1,10 @@
 
 #pragma once
 
+#include <algorithm>
 #include <functional>
 #include <string>
+#include <vector>
 #include <atomic>
 #include <condition_variable>
 
@@ -10,8 +12,12 @@
 #include "io_thread.h"
 #include "callback_function.h"
 #include "listen_socket.h"
+#include "acceptor.h"
 #include "thread_manager.h"
 
+// Timer of the server, the high byte holds the index of the thread that runs it
+using TimerId = uint64_t;
+
 template<typename T> requires HasSetFdFunction<T>
 class EventServer final {
 public:
@@ -21,6 +27,13 @@ public:
 
     ~EventServer() = default;
 
+    // How a new connection finds its IO thread
+    enum {
+        ACCEPT_IN_LOOP = 0,// the IO threads accept themselves, from their SO_REUSEPORT socket or a shared one
+        ACCEPT_LEAST_CONNECTIONS,// an acceptor thread hands it to the thread with the fewest open connections
+        ACCEPT_LEAST_EVENTS,// an acceptor thread hands it to the thread that handled the fewest events lately
+    };
+
     inline void SetOnCreate(OnCreate<T> &&func) {
         OnCreate_ = std::move(func);
     }
@@ -33,22 +46,161 @@ public:
         OnClose_ = std::move(func);
     }
 
+    // Serve every connection with a coroutine instead of OnMessage. It starts once the connection is
+    // set up and runs on its read thread, the connection is closed when it returns.
+    // OnCreate and OnClose are optional then, and still called around it when set
+    inline void SetOnConnection(CoHandler<T> &&func) {
+        OnConnection_ = std::move(func);
+    }
+
+    // Called when the unsent data of a connection rises to the high watermark,
+    // on the thread that queued or flushed it
+    inline void SetOnHighWatermark(OnHighWatermark<T> &&func) {
+        OnHighWatermark_ = std::move(func);
+    }
+
+    // Serve UDP instead of TCP: every thread binds its own SO_REUSEPORT socket to the listen address
+    // and the callback gets each datagram with its sender, reply with SendTo.
+    // OnCreate, OnMessage and OnClose are not used then
+    inline void SetOnDatagram(OnDatagram &&func) {
+        OnDatagram_ = std::move(func);
+    }
+
+    // Listen on the address as well: IPv4, IPv6 or a unix socket (SocketAddr::Unix).
+    // Every IO thread accepts on all of them, UDP mode takes a single one
     inline void AddListenAddr(const SocketAddr &addr) {
-        listenAddrs_ = addr;
+        listenAddrs_.push_back(addr);
     }
 
     inline void SetRwSeparation(bool separation = true) {
         rwSeparation_ = separation;
     }
 
+    // Use edge-triggered epoll: every connection is registered once, reads and writes
+    // drain until EAGAIN and sends no longer modify the epoll interest
+    inline void SetEdgeTrigger(bool edge = true) {
+        edgeTrigger_ = edge;
+    }
+
+    // Select the multiplexing, BaseEvent::EVENT_TYPE_*.
+    // io_uring falls back to epoll on kernels that do not support it
+    inline void SetEventType(int8_t type) {
+        eventType_ = type;
+    }
+
+    // Split the received data into frames, OnMessage is then called once per frame with its payload.
+    // Without a codec (the default) OnMessage gets whatever one read returned
+    inline void SetCodec(const std::shared_ptr<Codec> &codec) {
+        codec_ = codec;
+    }
+
+    // Close connections that have not received anything for timeout ms, 0 (the default) disables it.
+    // Every read only stores a timestamp, the per connection timer is moved when it fires
+    inline void SetIdleTimeout(int64_t timeout) {
+        idleTimeout_ = timeout;
+    }
+
+    // Bound the data queued for a slow client: OnHighWatermark fires when the unsent bytes
+    // of a connection reach high, and with pauseReading its reads stop until they drain to low.
+    // high 0 (the default) disables it
+    inline void SetWatermarks(size_t high, size_t low, bool pauseReading = true) {
+        highWatermark_ = high;
+        lowWatermark_ = low;
+        pauseReading_ = pauseReading;
+    }
+
+    // Send with MSG_ZEROCOPY while a connection has at least threshold bytes queued: the kernel reads
+    // the buffers in place instead of copying them, and they are released when it reports completion.
+    // Pays off for large responses only, and only on epoll. 0 (the default) disables it
+    inline void SetZeroCopy(size_t threshold) {
+        zeroCopyThreshold_ = threshold;
+    }
+
+    // Low-latency mode: after a poll that returned events the loops keep polling with a zero timeout
+    // for spin us before they block again, a request arriving meanwhile skips the wakeup through the
+    // scheduler. Costs a busy CPU per loop while there is traffic. socketPoll us, when set, goes to
+    // every connection as SO_BUSY_POLL with SO_PREFER_BUSY_POLL. 0 (the default) disables each.
+    // GetStats counts the polls of both kinds
+    inline void SetBusyPoll(int64_t spin, int socketPoll = 0) {
+        busyPollSpin_ = spin;
+        busyPollSocket_ = socketPoll;
+    }
+
+    // Idle outbound connections that Release keeps per address and IO thread, 8 by default
+    inline void SetPoolSize(size_t size) {
+        poolSize_ = size;
+    }
+
+    // Run OnMessage on a pool of threads worker threads instead of the read threads, so that a slow
+    // handler does not hold up the other connections of its thread. The messages of a connection still
+    // run in order and one at a time, idle workers steal from busy ones. SendPacket from a worker hands
+    // the message to the IO thread through its lock-free mailbox. OnCreate and OnClose stay on the
+    // read thread, OnClose may run while the last messages of the connection are being handled.
+    // 0 (the default) keeps OnMessage on the read threads, coroutine mode ignores it
+    inline void SetWorkerThreads(int threads) {
+        workerThreads_ = threads;
+    }
+
+    // Accept on a thread of its own and hand every connection to the IO thread that the balance picks,
+    // through the lock-free queue and the wakeup fd of its loop. Without SO_REUSEPORT the threads share
+    // one listen socket and whichever wins the accept keeps the connection, long-lived ones then pile up
+    // on a few threads. GetStats shows the open connections and the accepts of each loop.
+    // ACCEPT_IN_LOOP (the default) disables it
+    inline void SetAcceptBalance(int8_t balance) {
+        acceptBalance_ = balance;
+    }
+
+    // Pin the read and write threads of the i-th ThreadManager to cpus[i % cpus.size()].
+    // With SO_REUSEPORT each connection then goes to the thread that runs on the cpu
+    // that received it, keeping its packets and its processing on one core. Empty (the default) pins nothing
+    inline void SetCpuAffinity(const std::vector<int> &cpus) {
+        cpus_ = cpus;
+    }
+
     std::pair<bool, std::string> StartServer();
 
+    // Run the callback once after delay ms. Timers are spread over the IO threads and run on them,
+    // the callback must not block. Available after StartServer, return 0 before
+    TimerId RunAfter(int64_t delay, std::function<void()> &&callback);
+
+    // Run the callback every interval ms until the timer is cancelled
+    TimerId RunEvery(int64_t interval, std::function<void()> &&callback);
+
+    // Cancel a timer, from any thread
+    void CancelTimer(TimerId id);
+
     // Stop the server
     void StopServer();
 
     // Send message to the client
     void SendPacket(const T &conn, std::string &&msg);
 
+    // Open an outbound connection from an IO thread: the calling one when called on an IO thread,
+    // the next one in turn otherwise. The callback runs on that thread with the connection,
+    // or with nullptr and the reason when the connect failed or took longer than timeout ms (0 waits for the kernel).
+    // The connection gets OnCreate, OnMessage and OnClose like an accepted one
+    void Connect(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback);
+
+    // Like Connect, but reuse an idle connection to the address from the pool of the thread when there is one
+    void Acquire(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback);
+
+    // Return a connection made by Connect or Acquire to the pool of its thread once its exchange is over.
+    // It is closed when the pool of its address is full
+    void Release(const T &conn);
+
+    // Send a datagram to the peer in UDP mode, from any thread. On an IO thread it leaves
+    // through the socket of that thread with the other datagrams of the round
+    void SendTo(const SocketAddr &peer, std::string &&msg);
+
+    // Send length bytes of the file fd from offset, without reading them into memory: the segment
+    // is queued between the messages and written with sendfile. The fd is duplicated, the caller
+    // may close its own. Return false when the connection is gone or the fd cannot be duplicated
+    bool SendFile(const T &conn, int fd, off_t offset, size_t length);
+
+    // Snapshot of the counters of every event loop, from any thread after StartServer.
+    // The loops keep them without locks, ToPrometheus() formats the result for scraping
+    ServerStats GetStats();
+
     // Server Active close the connection
     void CloseConnection(const T &conn);
 
@@ -62,6 +214,15 @@ public:
 private:
     int Main();
 
+    // Bind the datagram socket of every thread and start them
+    int MainDatagram();
+
+    // The thread that dials out for the caller
+    ThreadManager<T> *ConnectThread();
+
+    // The thread for a connection of the acceptor, acceptor thread only
+    ThreadManager<T> *AcceptThread();
+
 private:
     OnCreate<T> OnCreate_;// The callback function when the connection is created
 
@@ -69,16 +230,67 @@ private:
 
     OnClose<T> OnClose_; // The callback function when the connection is closed
 
-    SocketAddr listenAddrs_; // The address to listen on
+    CoHandler<T> OnConnection_; // The coroutine that serves a connection, set in coroutine mode
+
+    OnHighWatermark<T> OnHighWatermark_; // The callback function when the unsent data reaches the high watermark
+
+    OnDatagram OnDatagram_; // The callback function when a datagram is received, set in UDP mode
+
+    std::vector<SocketAddr> listenAddrs_; // The addresses to listen on
 
     std::atomic<bool> running_ = true; // Whether the server is running
 
     bool rwSeparation_ = true;// Whether to separate read and write
 
+    int8_t eventType_ = 0;// The multiplexing type, 0 means the platform default
+
+    bool edgeTrigger_ = false;// Whether epoll is edge-triggered
+
+    int64_t idleTimeout_ = 0;// Idle connections are closed after this many ms, 0 means never
+
+    std::shared_ptr<Codec> codec_;// Splits the received data into frames
+
+    size_t highWatermark_ = 0;// Unsent bytes per connection that trigger OnHighWatermark, 0 means no limit
+
+    size_t lowWatermark_ = 0;// Unsent bytes at which reading resumes
+
+    bool pauseReading_ = true;// Whether reading stops above the high watermark
+
+    std::vector<int> cpus_;// The cpus the threads are pinned to
+
+    std::atomic<uint32_t> nextTimerThread_ = 0;// Round robin over the threads for the timers
+
+    std::atomic<uint32_t> nextConnectThread_ = 0;// Round robin for connects from other threads
+
+    size_t poolSize_ = 8;// Idle outbound connections kept per address and thread
+
+    size_t zeroCopyThreshold_ = 0;// Queued bytes from which sends use MSG_ZEROCOPY, 0 means never
+
+    int64_t busyPollSpin_ = 0;// us the loops poll without blocking after their last events, 0 means never
+
+    int busyPollSocket_ = 0;// SO_BUSY_POLL of the connections in us, 0 means not set
+
     int8_t threadNum_ = 1;// The number of threads
 
+    int workerThreads_ = 0;// The number of threads that run OnMessage, 0 means the read threads
+
     std::vector<std::unique_ptr<ThreadManager<T>>> threadsManager_;
 
+    std::shared_ptr<WorkerPool> workers_;// Destroyed first, its tasks call into the ThreadManagers
+
+    int8_t acceptBalance_ = ACCEPT_IN_LOOP;// How the acceptor picks the thread of a connection
+
+    std::unique_ptr<Acceptor> acceptor_;// Accepts for the threads unless ACCEPT_IN_LOOP, destroyed before them
+
+    const int64_t acceptWindow_ = 100;// ms over which ACCEPT_LEAST_EVENTS compares the threads
+
+    // ACCEPT_LEAST_EVENTS, acceptor thread only: the events of each thread at the last sample,
+    // the events since the sample before, and the connections handed out since the last sample
+    std::vector<uint64_t> acceptEvents_;
+    std::vector<uint64_t> acceptLoad_;
+    std::vector<uint64_t> acceptHanded_;
+    int64_t acceptSampled_ = 0;
+
     std::mutex mtx_;
     std::condition_variable cv_;
 };
@@ -90,27 +302,56 @@ std::pair<bool, std::string> EventServer<T>::StartServer() {
         return std::pair(false, "thread num must be greater than 0");
     }
 
-    if (!OnCreate_) {
-        return std::pair(false, "OnCreate_ must be set");
+    if (OnDatagram_ && listenAddrs_.size() != 1) {
+        return std::pair(false, "UDP mode listens on exactly one address");
     }
 
-    if (!OnMessage_) {
-        return std::pair(false, "OnMessage_ must be set");
+    if (!OnDatagram_ && !OnConnection_) {
+        if (!OnCreate_) {
+            return std::pair(false, "OnCreate_ must be set");
+        }
+
+        if (!OnMessage_) {
+            return std::pair(false, "OnMessage_ must be set");
+        }
+
+        if (!OnClose_) {
+            return std::pair(false, "OnClose_ must be set");
+        }
     }
 
-    if (!OnClose_) {
-        return std::pair(false, "OnClose_ must be set");
+    if (workerThreads_ > 0 && !OnDatagram_ && !OnConnection_) {
+        workers_ = std::make_shared<WorkerPool>(workerThreads_);
+        if (!workers_->Start()) {
+            return std::pair(false, "worker threads cannot be started");
+        }
     }
 
     for (int8_t i = 0; i < threadNum_; ++i) {
-        auto tm = std::make_unique<ThreadManager<T>>(i, rwSeparation_);
+        // A UDP thread sends from its read loop
+        auto tm = std::make_unique<ThreadManager<T>>(i, rwSeparation_ && !OnDatagram_);
         tm->SetOnCreate(OnCreate_);
         tm->SetOnMessage(OnMessage_);
         tm->SetOnClose(OnClose_);
+        tm->SetOnConnection(OnConnection_);
+        tm->SetEventType(eventType_);
+        tm->SetEdgeTrigger(edgeTrigger_);
+        tm->SetIdleTimeout(idleTimeout_);
+        tm->SetCodec(codec_);
+        tm->SetWatermarks(highWatermark_, lowWatermark_, pauseReading_);
+        tm->SetOnHighWatermark(OnHighWatermark_);
+        tm->SetOnDatagram(OnDatagram_);
+        tm->SetPoolSize(poolSize_);
+        tm->SetBusyPoll(busyPollSpin_, busyPollSocket_);
+        tm->SetZeroCopy(zeroCopyThreshold_);
+        tm->SetWorkerPool(workers_);
+        if (!cpus_.empty()) {
+            tm->SetCpu(cpus_[i % cpus_.size()]);
+        }
         threadsManager_.emplace_back(std::move(tm));
     }
 
-    if (Main() != static_cast<int>(NetListen::OK)) {
+    if ((OnDatagram_ ? MainDatagram() : Main()) != static_cast<int>(NetListen::OK)) {
         return std::pair(false, "Main function error");
     }
 
@@ -118,14 +359,30 @@ std::pair<bool, std::string> EventServer<T>::StartServer() {
 }
 
 
+template<typename T>
+requires HasSetFdFunction<T>
+ServerStats EventServer<T>::GetStats() {
+    ServerStats stats;
+    for (const auto &thread: threadsManager_) {
+        thread->CollectStats(&stats);
+    }
+    return stats;
+}
+
 template<typename T>
 requires HasSetFdFunction<T>
 void EventServer<T>::StopServer() {
     bool expected = true;
     if (running_.compare_exchange_strong(expected, false)) {
+        if (acceptor_) {
+            acceptor_->Stop();
+        }
         for (const auto &thread: threadsManager_) {
             thread->Stop();
         }
+        if (workers_) {// after the IO threads, nothing is submitted anymore
+            workers_->Stop();
+        }
     }
     cv_.notify_one();
 }
@@ -142,6 +399,128 @@ void EventServer<T>::SendPacket(const T &conn, std::string &&msg) {
     threadsManager_[thIndex]->SendPacket(conn, std::move(msg));
 }
 
+template<typename T>
+requires HasSetFdFunction<T>
+ThreadManager<T> *EventServer<T>::AcceptThread() {
+    size_t best = 0;
+    if (acceptBalance_ == ACCEPT_LEAST_EVENTS) {
+        auto now = TimerWheel::Clock();
+        if (now - acceptSampled_ >= acceptWindow_) {
+            for (size_t i = 0; i < threadsManager_.size(); ++i) {
+                auto events = threadsManager_[i]->Events();
+                acceptLoad_[i] = events - acceptEvents_[i];
+                acceptEvents_[i] = events;
+                acceptHanded_[i] = 0;
+            }
+            acceptSampled_ = now;
+        }
+        // A connection handed out since the sample counts with the average events of a connection,
+        // so that a burst of connects is not handed to the same thread until the next sample
+        uint64_t events = 0;
+        int64_t connections = 0;
+        for (size_t i = 0; i < threadsManager_.size(); ++i) {
+            events += acceptLoad_[i];
+            connections += threadsManager_[i]->Connections();
+        }
+        uint64_t perConnection = std::max<uint64_t>(1, events / std::max<int64_t>(1, connections));
+        uint64_t bestLoad = UINT64_MAX;
+        for (size_t i = 0; i < threadsManager_.size(); ++i) {
+            auto load = acceptLoad_[i] + acceptHanded_[i] * perConnection;
+            if (load < bestLoad) {
+                bestLoad = load;
+                best = i;
+            }
+        }
+        ++acceptHanded_[best];
+        return threadsManager_[best].get();
+    }
+
+    auto fewest = threadsManager_[0]->Connections();
+    for (size_t i = 1; i < threadsManager_.size(); ++i) {
+        auto connections = threadsManager_[i]->Connections();
+        if (connections < fewest) {
+            fewest = connections;
+            best = i;
+        }
+    }
+    return threadsManager_[best].get();
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+ThreadManager<T> *EventServer<T>::ConnectThread() {
+    for (const auto &thread: threadsManager_) {
+        if (thread->InThread()) {// upstream traffic stays on the thread of the request
+            return thread.get();
+        }
+    }
+    return threadsManager_[nextConnectThread_++ % threadsManager_.size()].get();
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void EventServer<T>::Connect(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback) {
+    if (threadsManager_.empty()) {
+        callback(nullptr, "server not started");
+        return;
+    }
+    ConnectThread()->Connect(addr, timeout, std::move(callback));
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void EventServer<T>::Acquire(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback) {
+    if (threadsManager_.empty()) {
+        callback(nullptr, "server not started");
+        return;
+    }
+    ConnectThread()->Acquire(addr, timeout, std::move(callback));
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void EventServer<T>::Release(const T &conn) {
+    int thIndex = -1;
+    int fd = 0;
+    if constexpr (IsPointer_v<T>) {
+        thIndex = conn->GetThreadIndex();
+        fd = conn->GetFd();
+    } else {
+        thIndex = conn.GetThreadIndex();
+        fd = conn.GetFd();
+    }
+    threadsManager_[thIndex]->Release(fd);
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void EventServer<T>::SendTo(const SocketAddr &peer, std::string &&msg) {
+    if (threadsManager_.empty()) {
+        return;
+    }
+    for (const auto &thread: threadsManager_) {
+        if (thread->InThread()) {
+            thread->SendTo(peer, std::move(msg));
+            return;
+        }
+    }
+    // Other threads keep the datagrams of one peer on one socket, in order
+    auto hash = std::hash<SocketAddr>()(peer);
+    threadsManager_[hash % threadsManager_.size()]->SendTo(peer, std::move(msg));
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+bool EventServer<T>::SendFile(const T &conn, int fd, off_t offset, size_t length) {
+    int thIndex = -1;
+    if constexpr (IsPointer_v<T>) {
+        thIndex = conn->GetThreadIndex();
+    } else {
+        thIndex = conn.GetThreadIndex();
+    }
+    return threadsManager_[thIndex]->SendFile(conn, fd, offset, length);
+}
+
 template<typename T>
 requires HasSetFdFunction<T>
 void EventServer<T>::CloseConnection(const T &conn) {
@@ -151,32 +530,134 @@ void EventServer<T>::CloseConnection(const T &conn) {
     } else {
         thIndex = conn.GetThreadIndex();
     }
-    threadsManager_[thIndex]->CloseConnection(conn.GetFd());
+    int fd = 0;
+    if constexpr (IsPointer_v<T>) {
+        fd = conn->GetFd();
+    } else {
+        fd = conn.GetFd();
+    }
+    threadsManager_[thIndex]->CloseConnection(fd);
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+TimerId EventServer<T>::RunAfter(int64_t delay, std::function<void()> &&callback) {
+    if (threadsManager_.empty()) {
+        return 0;
+    }
+    uint64_t index = nextTimerThread_++ % threadsManager_.size();
+    return (index << 56) | threadsManager_[index]->RunAfter(delay, std::move(callback));
 }
 
 template<typename T>
-requires HasSetFdFunction<T>int EventServer<T>::Main() {
-    std::shared_ptr<ListenSocket> listen(ListenSocket::CreateTCPListen());
-    listen->SetListenAddr(listenAddrs_);
+requires HasSetFdFunction<T>
+TimerId EventServer<T>::RunEvery(int64_t interval, std::function<void()> &&callback) {
+    if (threadsManager_.empty()) {
+        return 0;
+    }
+    uint64_t index = nextTimerThread_++ % threadsManager_.size();
+    return (index << 56) | threadsManager_[index]->RunEvery(interval, std::move(callback));
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void EventServer<T>::CancelTimer(TimerId id) {
+    auto index = id >> 56;
+    if (id == 0 || index >= threadsManager_.size()) {
+        return;
+    }
+    threadsManager_[index]->CancelTimer(id & ((uint64_t(1) << 56) - 1));
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+int EventServer<T>::Main() {
+    // The first socket of every address. The other threads bind their own ones to an address
+    // whose socket joined a SO_REUSEPORT group, and share it otherwise
+    std::vector<std::shared_ptr<ListenSocket>> listens;
+    for (const auto &addr: listenAddrs_) {
+        std::shared_ptr<ListenSocket> listen(ListenSocket::CreateTCPListen());
+        listen->SetListenAddr(addr);
+        if (auto ret = listen->Init(); ret != static_cast<int>(NetListen::OK)) {
+            return ret;
+        }
+        listens.push_back(std::move(listen));
+    }
+    if (listens.empty()) {
+        return static_cast<int>(NetListen::OPEN_ERROR);
+    }
+
+    if (acceptBalance_ != ACCEPT_IN_LOOP) {
+        // The threads get no listen socket, every connection comes through the acceptor
+        for (const auto &thread: threadsManager_) {
+            if (!thread->Start({})) {
+                return -1;
+            }
+        }
+        acceptEvents_.assign(threadsManager_.size(), 0);
+        acceptLoad_.assign(threadsManager_.size(), 0);
+        acceptHanded_.assign(threadsManager_.size(), 0);
+        acceptor_ = std::make_unique<Acceptor>(std::move(listens), [this](int fd) {
+            AcceptThread()->Adopt(fd);
+        });
+        return acceptor_->Start() ? static_cast<int>(NetListen::OK) : -1;
+    }
 
-    if (auto ret = listen->Init() != static_cast<int>(NetListen::OK)) {
-        return ret;
+    if (!cpus_.empty()) {
+        // The program belongs to the group, the sockets of the other threads join it below
+        std::vector<int> threadCpus;
+        for (size_t i = 0; i < threadsManager_.size(); ++i) {
+            threadCpus.push_back(cpus_[i % cpus_.size()]);
+        }
+        for (const auto &listen: listens) {
+            if (listen->ReusePort()) {
+                listen->AttachCpuSteering(threadCpus);
+            }
+        }
     }
 
+    for (size_t i = 0; i < threadsManager_.size(); ++i) {
+        ListenSockets threadListens;
+        for (const auto &listen: listens) {
+            if (i == 0 || !listen->ReusePort()) {
+                threadListens.push_back(listen);
+                continue;
+            }
+            std::shared_ptr<ListenSocket> own(ListenSocket::CreateTCPListen());
+            own->SetListenAddr(listen->ListenAddr());
+            if (auto ret = own->Init(); ret != static_cast<int>(NetListen::OK)) {
+                return ret;
+            }
+            threadListens.push_back(std::move(own));
+        }
+        if (!threadsManager_[i]->Start(threadListens)) {
+            return -1;
+        }
+    }
+
+    return static_cast<int>(NetListen::OK);
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+int EventServer<T>::MainDatagram() {
     int i = 0;
     for (const auto &thread: threadsManager_) {
-        if (i > 0 && ListenSocket::REUSE_PORT) {
-            listen.reset(ListenSocket::CreateTCPListen());
-            listen->SetListenAddr(listenAddrs_);
-            if (auto ret = listen->Init() != static_cast<int>(NetListen::OK)) {
-                return ret;
+        auto socket = std::make_unique<DatagramSocket>(listenAddrs_.front());
+        if (auto ret = socket->Init(); ret != static_cast<int>(NetListen::OK)) {
+            return ret;
+        }
+        if (i == 0 && !cpus_.empty()) {
+            std::vector<int> threadCpus;
+            for (size_t j = 0; j < threadsManager_.size(); ++j) {
+                threadCpus.push_back(cpus_[j % cpus_.size()]);
             }
+            socket->AttachCpuSteering(threadCpus);
         }
-        if (!thread->Start(listen)) {
+        if (!thread->StartDatagram(std::move(socket))) {
             return -1;
         }
         ++i;
     }
-
     return static_cast<int>(NetListen::OK);
 }
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <sys/resource.h>
+#include <atomic>
+#include <memory>
+
+// Table of entries indexed by fd. Slots are allocated in chunks on first use and never move,
+// so a lookup is two atomic loads without any lock. Every slot has a cache line of its own,
+// neighbouring fds are usually served by different threads.
+// The slab owns the entries it holds, Remove() hands the entry back to the caller,
+// who must keep it alive until no reader can still use it
+template<typename E>
+class FdSlab {
+public:
+    FdSlab();
+
+    ~FdSlab();
+
+    FdSlab(const FdSlab &) = delete;
+
+    FdSlab &operator=(const FdSlab &) = delete;
+
+    // Get the entry of the fd, nullptr when there is none
+    E *Get(int fd) const;
+
+    // Store the entry of the fd, false when the fd is out of range
+    bool Insert(int fd, E *entry);
+
+    // Remove the entry if it is still the one stored for the fd,
+    // only one of several concurrent callers succeeds
+    bool Remove(int fd, E *entry);
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<E *> entry = nullptr;
+    };
+
+    Slot *GetSlot(int fd, bool create);
+
+private:
+    static constexpr int chunkBits_ = 12;
+    static constexpr size_t chunkSize_ = 1 << chunkBits_;
+    static constexpr size_t maxFds_ = 1 << 24;// used when the fd limit is unlimited
+
+    size_t chunkCount_ = 0;
+    std::unique_ptr<std::atomic<Slot *>[]> chunks_;
+};
+
+template<typename E>
+FdSlab<E>::FdSlab() {
+    // Cover every fd the process may open
+    size_t fds = maxFds_;
+    struct rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_max != RLIM_INFINITY && limit.rlim_max < maxFds_) {
+        fds = limit.rlim_max;
+    }
+    chunkCount_ = (fds + chunkSize_ - 1) >> chunkBits_;
+    chunks_ = std::make_unique<std::atomic<Slot *>[]>(chunkCount_);
+}
+
+template<typename E>
+FdSlab<E>::~FdSlab() {
+    for (size_t i = 0; i < chunkCount_; ++i) {
+        auto chunk = chunks_[i].load();
+        if (!chunk) {
+            continue;
+        }
+        for (size_t j = 0; j < chunkSize_; ++j) {
+            delete chunk[j].entry.load();
+        }
+        delete[] chunk;
+    }
+}
+
+template<typename E>
+E *FdSlab<E>::Get(int fd) const {
+    if (fd < 0 || static_cast<size_t>(fd >> chunkBits_) >= chunkCount_) {
+        return nullptr;
+    }
+    auto chunk = chunks_[fd >> chunkBits_].load(std::memory_order_acquire);
+    if (!chunk) {
+        return nullptr;
+    }
+    return chunk[fd & (chunkSize_ - 1)].entry.load();
+}
+
+template<typename E>
+bool FdSlab<E>::Insert(int fd, E *entry) {
+    auto slot = GetSlot(fd, true);
+    if (!slot) {
+        return false;
+    }
+    slot->entry.store(entry);
+    return true;
+}
+
+template<typename E>
+bool FdSlab<E>::Remove(int fd, E *entry) {
+    auto slot = GetSlot(fd, false);
+    if (!slot) {
+        return false;
+    }
+    return slot->entry.compare_exchange_strong(entry, nullptr);
+}
+
+template<typename E>
+typename FdSlab<E>::Slot *FdSlab<E>::GetSlot(int fd, bool create) {
+    if (fd < 0 || static_cast<size_t>(fd >> chunkBits_) >= chunkCount_) {
+        return nullptr;
+    }
+    auto &chunkPtr = chunks_[fd >> chunkBits_];
+    auto chunk = chunkPtr.load(std::memory_order_acquire);
+    if (!chunk && create) {
+        auto newChunk = new Slot[chunkSize_];
+        if (chunkPtr.compare_exchange_strong(chunk, newChunk, std::memory_order_acq_rel)) {
+            chunk = newChunk;
+        } else {// another thread allocated it first
+            delete[] newChunk;
+        }
+    }
+    if (!chunk) {
+        return nullptr;
+    }
+    return &chunk[fd & (chunkSize_ - 1)];
+}
@@ -0,0 +1,54 @@
+#include <new>
+
+#include "frame_pool.h"
+
+namespace {
+
+// A free frame holds the link to the next one
+struct FreeFrame {
+    FreeFrame *next;
+};
+
+struct FreeLists {
+    FreeFrame *head[FramePool::classes_] = {};
+    size_t count[FramePool::classes_] = {};
+
+    ~FreeLists() {
+        for (size_t i = 0; i < FramePool::classes_; ++i) {
+            while (head[i]) {
+                auto frame = head[i];
+                head[i] = frame->next;
+                ::operator delete(frame);
+            }
+        }
+    }
+};
+
+thread_local FreeLists freeLists;
+
+}
+
+void *FramePool::Allocate(size_t size) {
+    auto index = (size - 1) / classSize_;
+    if (index >= classes_) {
+        return ::operator new(size);
+    }
+    if (auto frame = freeLists.head[index]) {
+        freeLists.head[index] = frame->next;
+        --freeLists.count[index];
+        return frame;
+    }
+    return ::operator new((index + 1) * classSize_);
+}
+
+void FramePool::Deallocate(void *frame, size_t size) {
+    auto index = (size - 1) / classSize_;
+    if (index >= classes_ || freeLists.count[index] >= maxFree_) {
+        ::operator delete(frame);
+        return;
+    }
+    auto free = static_cast<FreeFrame *>(frame);
+    free->next = freeLists.head[index];
+    freeLists.head[index] = free;
+    ++freeLists.count[index];
+}
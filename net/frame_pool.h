@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+// Free lists of coroutine frames, one set per thread. A frame is allocated on the IO thread
+// that runs its coroutine and is usually freed there again, the lists then need no lock.
+// Frames are grouped in size classes of classSize_ bytes, larger ones go to the heap
+class FramePool {
+public:
+    static void *Allocate(size_t size);
+
+    // The size must be the one the frame was allocated with
+    static void Deallocate(void *frame, size_t size);
+
+    static constexpr size_t classSize_ = 64;
+    static constexpr size_t classes_ = 32;// pooled up to 2KB
+    static constexpr size_t maxFree_ = 256;// frames kept per class and thread
+};
@@ -1,6 +1,24 @@
 
+#include "config.h"
 #include "io_thread.h"
 
+#ifdef HAVE_SCHED_AFFINITY
+
+#include <pthread.h>
+#include <sched.h>
+
+#endif
+
+// Pin the calling thread, a cpu outside the allowed set leaves it unpinned
+static void PinThread(int cpu) {
+#ifdef HAVE_SCHED_AFFINITY
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
 void IOThread::Stop() {
     if (!running_.load()) {
         return;
@@ -23,6 +41,9 @@ bool IOThread::Run() {
     }
 
     thread_ = std::thread([this] {
+        if (cpu_ >= 0) {// before the loop allocates anything, so that its memory is local to the cpu
+            PinThread(cpu_);
+        }
         baseEvent_->EventPoll();
     });
     return true;
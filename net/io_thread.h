@@ -14,22 +14,78 @@ public:
     // Initialize the event and run the event loop
     bool Run();
 
-    inline void CloseConnection(int fd) { baseEvent_->DelEvent(fd); }
-
     // Stop the event loop and wait for the thread to exit
     void Stop();
 
     // Wait for the thread to exit
     void Wait();
 
+    // Run the event loop on the cpu, -1 lets the scheduler choose. Set before Run
+    inline void SetCpu(int cpu) {
+        cpu_ = cpu;
+    }
+
+    // Whether the caller runs on the event loop of this thread
+    inline bool InThread() const {
+        return std::this_thread::get_id() == thread_.get_id();
+    }
+
     // Add read event to epoll when send message to client
-    inline void SetWriteEvent(int fd) {
-        baseEvent_->AddWriteEvent(fd);
+    inline void SetWriteEvent(Connection *conn) {
+        baseEvent_->AddWriteEvent(conn);
+    }
+
+    // Hand a message to the event loop, which sends it on its own thread
+    inline void PostSend(const std::shared_ptr<Connection> &conn, std::string &&msg) {
+        baseEvent_->PostSend(conn, std::move(msg));
+    }
+
+    // The multiplex of the thread
+    inline const std::shared_ptr<BaseEvent> &Event() const {
+        return baseEvent_;
+    }
+
+    // Hand a file segment to the event loop, in order with the messages
+    inline void PostSendFile(const std::shared_ptr<Connection> &conn, FileSegment &&file) {
+        baseEvent_->PostSendFile(conn, std::move(file));
     }
 
     // Add new event to epoll when new connection
-    inline void AddNewEvent(int fd, int mask) {
-        baseEvent_->AddEvent(fd, mask);
+    inline void AddNewEvent(Connection *conn, int mask) {
+        baseEvent_->AddEvent(conn, mask);
+    }
+
+    // Run the task on the event loop, right away when called from it
+    inline void RunInLoop(std::function<void()> &&task) {
+        baseEvent_->RunInLoop(std::move(task));
+    }
+
+    // Run the task on the event loop at the end of its current round
+    inline void QueueInLoop(std::function<void()> &&task) {
+        baseEvent_->QueueInLoop(std::move(task));
+    }
+
+    // Run the callback on the event loop after delay ms, and then every interval ms when interval > 0
+    inline uint64_t RunTimer(int64_t delay, int64_t interval, std::function<void()> &&callback) {
+        return baseEvent_->RunTimer(delay, interval, std::move(callback));
+    }
+
+    inline void CancelTimer(uint64_t id) {
+        baseEvent_->CancelTimer(id);
+    }
+
+    // Finished poll rounds of the event loop
+    inline uint64_t Generation() const {
+        return baseEvent_->Generation();
+    }
+
+    inline LoopStats &Stats() {
+        return baseEvent_->Stats();
+    }
+
+    // Wake up the event loop so that it finishes its round
+    inline void Wakeup() {
+        baseEvent_->Wakeup();
     }
 
 protected:
@@ -37,6 +93,8 @@ protected:
 
     std::thread thread_;
 
+    int cpu_ = -1;
+
     std::shared_ptr<BaseEvent> baseEvent_;// Event object
 };
 
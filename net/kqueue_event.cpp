@@ -3,6 +3,8 @@
 
 #ifdef HAVE_KQUEUE
 
+#include "listen_socket.h"
+
 const int BaseEvent::EVENT_READ = EVFILT_READ;
 const int BaseEvent::EVENT_WRITE = EVFILT_WRITE;
 const int BaseEvent::EVENT_ERROR = EV_ERROR;
@@ -13,37 +15,60 @@ bool KqueueEvent::Init() {
     if (fd_ == -1) {
         return false;
     }
-    if (mode_ & EVENT_MODE_READ) {
-        AddEvent(listen_->Fd(), EVENT_READ);
+    // The udata of a listen socket is the socket itself and nullptr for the wakeup fd,
+    // every other fd carries its Connection
+    for (auto &listen: listens_) {// a UDP loop has none
+        if (mode_ & EVENT_MODE_READ) {
+            AddFilter(listen->Fd(), EVENT_READ, listen.get());
+        }
     }
-    pipe(pipeFd);
-    AddEvent(pipeFd[0], EVENT_READ | EVENT_ERROR | EVENT_HUB);
+    if (!OpenWakeup()) {
+        return false;
+    }
+    AddFilter(wakeupFd_[0], EVENT_READ, nullptr);
     return true;
 }
 
-void KqueueEvent::AddEvent(int fd, int mask) {
-    struct kevent change;
-    EV_SET(&change, fd, mask, EV_ADD, 0, 0, nullptr);
-    kevent(Fd(), &change, 1, nullptr, 0, nullptr);
+void KqueueEvent::AddEvent(Connection *conn, int mask) {
+    AddFilter(conn->fd_, mask, conn);
 }
 
 void KqueueEvent::DelEvent(int fd) {
     struct kevent change;
     EV_SET(&change, fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    stats_.ctls.Add(1);
     kevent(Fd(), &change, 1, nullptr, 0, nullptr);
 }
 
-void KqueueEvent::AddWriteEvent(int fd) {
-    AddEvent(fd,EVENT_WRITE);
+void KqueueEvent::AddWriteEvent(Connection *conn) {
+    AddFilter(conn->fd_, EVENT_WRITE, conn);
 }
 
-void KqueueEvent::DelWriteEvent(int fd) {
+void KqueueEvent::DelWriteEvent(Connection *conn) {
     struct kevent change;
-    EV_SET(&change, fd, EVENT_WRITE, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&change, conn->fd_, EVENT_WRITE, EV_DELETE, 0, 0, nullptr);
+    stats_.ctls.Add(1);
     kevent(Fd(), &change, 1, nullptr, 0, nullptr);
 }
 
+void KqueueEvent::SetReadEnabled(Connection *conn, bool enabled) {
+    if (conn->readPaused_ == !enabled) {
+        return;
+    }
+    conn->readPaused_ = !enabled;
+    struct kevent change;
+    EV_SET(&change, conn->fd_, EVENT_READ, enabled ? EV_ENABLE : EV_DISABLE, 0, 0, conn);
+    stats_.ctls.Add(1);
+    kevent(Fd(), &change, 1, nullptr, 0, nullptr);
+}
+
+void KqueueEvent::AddConnectEvent(Connection *conn) {
+    conn->connecting_ = true;
+    AddFilter(conn->fd_, EVENT_WRITE, conn);
+}
+
 void KqueueEvent::EventPoll() {
+    StartLoop();
     if (mode_ & EVENT_MODE_READ) {
         EventRead();
     } else {
@@ -54,80 +79,132 @@ void KqueueEvent::EventPoll() {
 void KqueueEvent::EventRead() {
     struct kevent events[eventsSize];
     while (running_) {
-        int nev = kevent(Fd(), nullptr, 0, events, eventsSize, nullptr);
+        int timeout = PollTimeout();
+        struct timespec ts{timeout / 1000, (timeout % 1000) * 1000000};
+        int nev = kevent(Fd(), nullptr, 0, events, eventsSize, timeout < 0 ? nullptr : &ts);
+        CountPoll(nev);
         for (int i = 0; i < nev; ++i) {
-            if ((events[i].flags & EVENT_HUB) || (events[i].flags & EVENT_ERROR)) {
-                DoError(events[i], "");
+            if (auto listen = FindListen(events[i].udata)) {
+                DoAccept(static_cast<ListenSocket *>(listen));
+                continue;
+            }
+            auto conn = static_cast<Connection *>(events[i].udata);
+            if (!conn) {
+                DrainWakeup();
+                DrainMailbox();
+                continue;
+            }
+            if (conn->closed_) {
+                continue;
+            }
+            if (conn->connecting_) {// EV_EOF reports a failed connect, the connection checks it
+                DoConnect(conn);
                 continue;
             }
-            std::shared_ptr<Connection> conn;
-            if (events[i].filter == EVENT_READ) {
-                if (events[i].ident != listen_->Fd()) {
-                    conn = getConn_(events[i].ident);
-                }
-                DoRead(events[i], conn);
+            if (events[i].flags & EVENT_ERROR) {
+                DoError(conn, "");
+                continue;
+            }
+            if (events[i].filter == EVENT_READ) {// EV_EOF comes with the data before it, the read sees the end
+                DoRead(conn);
+            } else if (events[i].flags & EVENT_HUB) {// the connection can take no more data
+                DoError(conn, "");
             } else if ((mode_ & EVENT_MODE_WRITE) && events[i].filter == EVENT_WRITE) {
-                conn = getConn_(events[i].ident);
-                if (!conn) {
-                    DoError(events[i], "write conn is null");
-                    continue;
-                }
-                DoWrite(events[i], conn);
+                DoWrite(conn);
             }
         }
+        EndRound();
     }
 }
 
 void KqueueEvent::EventWrite() {
     struct kevent events[eventsSize];
     while (running_) {
-        int nev = kevent(Fd(), nullptr, 0, events, eventsSize, nullptr);
+        int timeout = PollTimeout();
+        struct timespec ts{timeout / 1000, (timeout % 1000) * 1000000};
+        int nev = kevent(Fd(), nullptr, 0, events, eventsSize, timeout < 0 ? nullptr : &ts);
+        CountPoll(nev);
         for (int i = 0; i < nev; ++i) {
-            if ((events[i].flags & EVENT_HUB) || (events[i].flags & EVENT_ERROR)) {
-                DoError(events[i], "EventWrite error");
+            auto conn = static_cast<Connection *>(events[i].udata);
+            if (!conn) {
+                DrainWakeup();
+                DrainMailbox();
                 continue;
             }
-            auto conn = getConn_(events[i].ident);
-            if (!conn) {
-                DoError(events[i], "write conn is null");
+            if (conn->closed_) {
+                continue;
+            }
+            if ((events[i].flags & EVENT_HUB) || (events[i].flags & EVENT_ERROR)) {
+                DoError(conn, "EventWrite error");
                 continue;
             }
             if (events[i].filter == EVENT_WRITE) {
-                DoWrite(events[i], conn);
+                DoWrite(conn);
             }
         }
+        EndRound();
     }
 }
 
-void KqueueEvent::DoRead(const struct kevent &event, const std::shared_ptr<Connection> &conn) {
-    if (event.ident == listen_->Fd()) {
-        auto newConn = std::make_shared<Connection>(shared_from_this(), nullptr);
-        auto connFd = listen_->OnReadable(newConn, nullptr);
-        onCreate_(connFd, newConn);
-    } else if (conn) {
-        std::string readBuff;
-        int ret = conn->netEvent_->OnReadable(conn, &readBuff);
+void KqueueEvent::DoAccept(ListenSocket *listen) {
+    for (int i = 0; i < acceptBudget; ++i) {
+        auto fd = listen->Accept();
+        if (fd < 0) {
+            return;
+        }
+        stats_.accepts.Add(1);
+        auto newConn = Connection::Create(shared_from_this());
+        onCreate_(listen->OnAccepted(newConn, fd), newConn);
+    }
+}
 
-        onMessage_(event.ident, std::move(readBuff));
-    } else {
-        DoError(event, "DoRead error");
+void KqueueEvent::DoRead(Connection *conn) {
+    std::string readBuff = std::move(conn->readBuff_);// the partial frame of the last read, if any
+    int ret = conn->netEvent_->OnReadable(nullptr, &readBuff);
+    if (ret == NE_ERROR) {
+        DoError(conn, "DoRead error");
+        return;
+    }
+    bool peerClosed = conn->netEvent_->PeerClosed();
+    if (!peerClosed || !readBuff.empty()) {
+        onMessage_(conn, std::move(readBuff));
+    }
+    if (peerClosed && OnEndOfStream(conn)) {
+        DoError(conn, "");
     }
 }
 
-void KqueueEvent::DoWrite(const struct kevent &event, const std::shared_ptr<Connection> &conn) {
+void KqueueEvent::DoWrite(Connection *conn) {
     auto ret = conn->netEvent_->OnWritable();
     if (ret == NE_ERROR) {
-        DoError(event, "DoWrite error");
+        DoError(conn, "DoWrite error");
         return;
     }
     if (ret == 0) {
-        DelWriteEvent(event.ident);
+        if (Drained(conn)) {// the last answer to a peer that has finished
+            DoError(conn, "");
+            return;
+        }
+        DelWriteEvent(conn);
     }
 }
 
-void KqueueEvent::DoError(const struct kevent &event, std::string &&err) {
-    DelEvent(event.ident);
-    onClose_(event.ident, std::move(err));
+void KqueueEvent::DoConnect(Connection *conn) {
+    conn->connecting_ = false;
+    DelWriteEvent(conn);
+    onConnect_(conn);
+}
+
+void KqueueEvent::DoError(Connection *conn, std::string &&err) {
+    // Closing the socket removes it from the kqueue
+    onClose_(conn, std::move(err));
+}
+
+void KqueueEvent::AddFilter(int fd, int filter, void *udata) {
+    struct kevent change;
+    EV_SET(&change, fd, filter, EV_ADD, 0, 0, udata);
+    stats_.ctls.Add(1);
+    kevent(Fd(), &change, 1, nullptr, 0, nullptr);
 }
 
 #endif
\ No newline at end of file
@@ -12,10 +12,12 @@
 
 #include "base_event.h"
 
+class ListenSocket;
+
 class KqueueEvent : public BaseEvent {
 public:
-    explicit KqueueEvent(std::shared_ptr<NetEvent> listen, int8_t mode) : BaseEvent(std::move(listen), mode,
-                                                                                    BaseEvent::EVENT_TYPE_KQUEUE) {
+    explicit KqueueEvent(ListenSockets listens, int8_t mode) : BaseEvent(std::move(listens), mode,
+                                                                         BaseEvent::EVENT_TYPE_KQUEUE) {
     };
 
     ~KqueueEvent() override {
@@ -24,13 +26,17 @@ public:
 
     bool Init() override;
 
-    void AddEvent(int fd, int mask) override;
+    void AddEvent(Connection *conn, int mask) override;
 
     void DelEvent(int fd) override;
 
-    void AddWriteEvent(int fd) override;
+    void AddWriteEvent(Connection *conn) override;
+
+    void DelWriteEvent(Connection *conn) override;
 
-    void DelWriteEvent(int fd) override;
+    void SetReadEnabled(Connection *conn, bool enabled) override;
+
+    void AddConnectEvent(Connection *conn) override;
 
     void EventPoll() override;
 
@@ -38,14 +44,24 @@ public:
 
     void EventWrite();
 
-    void DoRead(const struct kevent &event, const std::shared_ptr<Connection> &conn);
+    void DoAccept(ListenSocket *listen);
+
+    void DoRead(Connection *conn);
 
-    void DoWrite(const struct kevent &event, const std::shared_ptr<Connection> &conn);
+    void DoWrite(Connection *conn);
 
-    void DoError(const struct kevent &event, std::string &&err);
+    void DoConnect(Connection *conn);
+
+    void DoError(Connection *conn, std::string &&err);
 
 private:
+    // Register the filter, udata is returned with its events
+    void AddFilter(int fd, int filter, void *udata);
+
     const int eventsSize = 1020;
+
+    // Connections accepted per listen event, the rest is reported in the next round
+    const int acceptBudget = 64;
 };
 
 #endif
\ No newline at end of file
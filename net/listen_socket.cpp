@@ -1,5 +1,10 @@
 
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <mutex>
 
 #include "config.h"
 #include "listen_socket.h"
@@ -9,12 +14,25 @@ const int ListenSocket::LISTENQ = 1024;
 
 bool ListenSocket::REUSE_PORT = true;
 
+namespace {
+
+// Opened with the first listen socket and given up for a moment when the process is out of fds,
+// shared by all listen sockets
+std::mutex spareMutex;
+int spareFd = -1;
+
+}
+
 int ListenSocket::OnReadable(const std::shared_ptr<Connection> &conn, std::string *readBuff) {
     auto newConnFd = Accept();
-    if (newConnFd == 0) {
+    if (newConnFd < 0) {
         return NE_ERROR;
     }
 
+    return OnAccepted(conn, newConnFd);
+}
+
+int ListenSocket::OnAccepted(const std::shared_ptr<Connection> &conn, int newConnFd) {
     auto newConn = std::make_unique<StreamSocket>(newConnFd, SocketType());
 
     newConn->OnCreate();
@@ -56,13 +74,13 @@ bool ListenSocket::Open() {
     }
 
     if (SocketType() == SOCKET_LISTEN_TCP) {
-        fd_ = CreateTCPSocket();
-    } else if (SocketType() == SOCKET_LISTEN_UDP) {
-        fd_ = CreateUDPSocket();
+        fd_ = CreateTCPSocket(addr_.Family());
+    } else if (SocketType() == SOCKET_LISTEN_UDP && AF_UNIX != addr_.Family()) {
+        fd_ = CreateUDPSocket(addr_.Family());
     } else {
         return false;
     }
-    return true;
+    return Fd() > 0;
 }
 
 bool ListenSocket::Bind() {
@@ -70,17 +88,26 @@ bool ListenSocket::Bind() {
         return false;
     }
 
-    fd_ = CreateTCPSocket();
     SetNonBlock(true);
-    SetNodelay();
-    SetReuseAddr();
-    if (!SetReusePort()) {
-        REUSE_PORT = true;
+    if (AF_UNIX == addr_.Family()) {
+        // A unix socket has no port to share, every thread uses this one. The file left behind
+        // by an earlier run would fail the bind, a path that is not a socket stays untouched
+        auto path = addr_.Path();
+        struct stat st{};
+        if (!path.empty() && path[0] != '@' && 0 == ::stat(path.c_str(), &st) && S_ISSOCK(st.st_mode)) {
+            ::unlink(path.c_str());
+        }
+    } else {
+        SetNodelay();
+        SetReuseAddr();
+        // Cleared beforehand, every thread shares this socket
+        reusePort_ = REUSE_PORT && SetReusePort();
+        if (!reusePort_) {
+            REUSE_PORT = false;
+        }
     }
 
-    struct sockaddr_in serv = addr_.GetAddr();
-
-    int ret = ::bind(Fd(), reinterpret_cast<struct sockaddr *>(&serv), sizeof serv);
+    int ret = ::bind(Fd(), addr_.Data(), addr_.Length());
     if (0 != ret) {
         Close();
         return false;
@@ -94,14 +121,42 @@ bool ListenSocket::Listen() {
         Close();
         return false;
     }
+    std::lock_guard<std::mutex> lock(spareMutex);
+    if (spareFd < 0) {
+        spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
     return true;
 }
 
+void ListenSocket::Refuse() {
+    std::lock_guard<std::mutex> lock(spareMutex);
+    if (spareFd < 0) {// lost to another thread last time
+        spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (spareFd < 0) {
+            return;
+        }
+    }
+    ::close(spareFd);
+    // The fd is taken before the backlog is looked at, out of fds accept fails also when it is empty
+    auto fd = ::accept(Fd(), nullptr, nullptr);
+    int err = fd < 0 ? errno : ECONNABORTED;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    spareFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    errno = err;
+}
+
 int ListenSocket::Accept() {
-    socklen_t addrLength = sizeof(addr_);
+    // The peer address is not used, the listen address must not be overwritten
 #ifdef HAVE_ACCEPT4
-    return ::accept4(Fd(), reinterpret_cast<struct sockaddr *>(&addr_), &addrLength, SOCK_NONBLOCK);
+    auto fd = ::accept4(Fd(), nullptr, nullptr, SOCK_NONBLOCK);
 #else
-    return ::accept(Fd(), reinterpret_cast<struct sockaddr *>(&addr_), &addrLength);
+    auto fd = ::accept(Fd(), nullptr, nullptr);
 #endif
+    // A connection left in the backlog keeps the socket readable, whoever polls it would spin
+    if (fd < 0 && (EMFILE == errno || ENFILE == errno)) {
+        Refuse();
+    }
+    return fd;
 }
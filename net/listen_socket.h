@@ -4,6 +4,7 @@
 #include <cstring>
 #include <atomic>
 #include <memory>
+#include <vector>
 
 #include "base_socket.h"
 
@@ -25,10 +26,28 @@ public:
         addr_ = addr;
     }
 
+    inline const SocketAddr &ListenAddr() const {
+        return addr_;
+    }
+
+    // Whether the socket joined a SO_REUSEPORT group, so every thread may bind one of its own.
+    // Never for a unix socket
+    inline bool ReusePort() const {
+        return reusePort_;
+    }
+
     // Accept new connection and create new connection object
     // when the connection is established, the OnCreate function is called
     int OnReadable(const std::shared_ptr<Connection> &conn, std::string *readBuff) override;
 
+    // Create the connection object for a fd accepted by the multiplex itself
+    int OnAccepted(const std::shared_ptr<Connection> &conn, int newConnFd);
+
+    // Accept a pending connection, return -1 once the backlog is empty (EAGAIN) or on error.
+    // When the process is out of fds the connection is refused with a spare fd kept for that,
+    // errno is ECONNABORTED then, EAGAIN when none was pending and EMFILE or ENFILE without a spare fd
+    int Accept();
+
     // The function is cant be used
     int OnWritable() override;
 
@@ -52,9 +71,10 @@ private:
     // Start listening
     bool Listen();
 
-private:
-    // Accept new connection
-    int Accept();
+    // Take the first pending connection with the spare fd and close it, errno tells how it went, see Accept
+    void Refuse();
 
+private:
     SocketAddr addr_; // Listen address
+    bool reusePort_ = false;
 };
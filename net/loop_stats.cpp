@@ -0,0 +1,99 @@
+#include <cstdio>
+
+#include "loop_stats.h"
+
+thread_local LoopStats *LoopStats::current_ = nullptr;
+
+LoopStatsSnapshot &LoopStatsSnapshot::operator+=(const LoopStatsSnapshot &other) {
+    accepts += other.accepts;
+    bytesRead += other.bytesRead;
+    bytesWritten += other.bytesWritten;
+    reads += other.reads;
+    writes += other.writes;
+    polls += other.polls;
+    events += other.events;
+    ctls += other.ctls;
+    callbackNs += other.callbackNs;
+    spins += other.spins;
+    sleeps += other.sleeps;
+    pendingSendBytes += other.pendingSendBytes;
+    connections += other.connections;
+    return *this;
+}
+
+LoopStatsSnapshot LoopStats::Snapshot() const {
+    LoopStatsSnapshot s;
+    s.accepts = accepts.Get();
+    s.bytesRead = bytesRead.Get();
+    s.bytesWritten = bytesWritten.Get();
+    s.reads = reads.Get();
+    s.writes = writes.Get();
+    s.polls = polls.Get();
+    s.events = events.Get();
+    s.ctls = ctls.Get();
+    s.callbackNs = callbackNs.Get();
+    s.spins = spins.Get();
+    s.sleeps = sleeps.Get();
+    s.pendingSendBytes = pendingSendBytes.load(std::memory_order_relaxed);
+    s.connections = connections.load(std::memory_order_relaxed);
+    return s;
+}
+
+LoopStatsSnapshot ServerStats::Total() const {
+    LoopStatsSnapshot total;
+    for (const auto &loop: loops) {
+        total += loop.stats;
+    }
+    return total;
+}
+
+std::string ServerStats::ToPrometheus(const std::string &prefix) const {
+    struct Metric {
+        const char *name;
+        const char *type;
+        const char *help;
+        double (*value)(const LoopStatsSnapshot &s);
+    };
+    static const Metric metrics[] = {
+            {"accepts_total",          "counter", "Connections accepted.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.accepts); }},
+            {"read_bytes_total",       "counter", "Bytes received.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.bytesRead); }},
+            {"written_bytes_total",    "counter", "Bytes sent.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.bytesWritten); }},
+            {"reads_total",            "counter", "Read syscalls or recv completions.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.reads); }},
+            {"writes_total",           "counter", "Write syscalls or send completions.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.writes); }},
+            {"polls_total",            "counter", "Wakeups of the event loop.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.polls); }},
+            {"events_total",           "counter", "Events handled by the event loop.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.events); }},
+            {"ctls_total",             "counter", "Changes of the poll interest.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.ctls); }},
+            {"callback_seconds_total", "counter", "Time spent in application callbacks.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.callbackNs) / 1e9; }},
+            {"busy_spins_total",       "counter", "Polls with a zero timeout while busy polling.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.spins); }},
+            {"busy_sleeps_total",      "counter", "Polls allowed to block after the spin budget ran out.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.sleeps); }},
+            {"pending_send_bytes",     "gauge",   "Bytes queued on the connections and not sent yet.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.pendingSendBytes); }},
+            {"connections",            "gauge",   "Open connections.",
+                    [](const LoopStatsSnapshot &s) { return static_cast<double>(s.connections); }},
+    };
+
+    std::string out;
+    char value[32];
+    for (const auto &metric: metrics) {
+        auto name = prefix + "_" + metric.name;
+        out += "# HELP " + name + " " + metric.help + "\n";
+        out += "# TYPE " + name + " " + metric.type + "\n";
+        for (const auto &loop: loops) {
+            snprintf(value, sizeof(value), "%.17g", metric.value(loop.stats));
+            out += name + "{thread=\"" + std::to_string(loop.thread) + "\",loop=\"" +
+                   (loop.write ? "write" : "read") + "\"} " + value + "\n";
+        }
+    }
+    return out;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A counter written by one thread only. The writer adds with a relaxed load and store
+// instead of a locked instruction, readers on other threads see a value that is at most a moment old
+class LoopCounter {
+public:
+    inline void Add(uint64_t n) {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    inline uint64_t Get() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value_ = 0;
+};
+
+// Values of the counters of one event loop at the time of the snapshot
+struct LoopStatsSnapshot {
+    uint64_t accepts = 0;// connections accepted
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+    uint64_t reads = 0;// read syscalls, or recv completions with io_uring
+    uint64_t writes = 0;// write syscalls, or send completions with io_uring
+    uint64_t polls = 0;// returns of epoll_wait, kevent or io_uring_enter
+    uint64_t events = 0;// events or completions handled, events / polls is the batch per wakeup
+    uint64_t ctls = 0;// epoll_ctl and kevent changes
+    uint64_t callbackNs = 0;// time spent in the callbacks of the application
+    uint64_t spins = 0;// polls with a zero timeout while busy polling
+    uint64_t sleeps = 0;// polls allowed to block once the spin budget ran out, both stay 0 without busy polling
+    int64_t pendingSendBytes = 0;// data queued on the connections and not sent yet
+    int64_t connections = 0;// open connections
+
+    LoopStatsSnapshot &operator+=(const LoopStatsSnapshot &other);
+};
+
+// Counters of one event loop, on cache lines of their own so that two loops never share one.
+// Only the loop thread updates the counters, through Current(). The gauges change
+// on whichever thread queues data or closes a connection and use atomic adds
+struct alignas(64) LoopStats {
+    LoopCounter accepts;
+    LoopCounter bytesRead;
+    LoopCounter bytesWritten;
+    LoopCounter reads;
+    LoopCounter writes;
+    LoopCounter polls;
+    LoopCounter events;
+    LoopCounter ctls;
+    LoopCounter callbackNs;
+    LoopCounter spins;
+    LoopCounter sleeps;
+    alignas(64) std::atomic<int64_t> pendingSendBytes = 0;
+    std::atomic<int64_t> connections = 0;
+
+    LoopStatsSnapshot Snapshot() const;
+
+    // Stats of the event loop running on the calling thread, nullptr on other threads
+    static inline LoopStats *Current() {
+        return current_;
+    }
+
+    static inline void SetCurrent(LoopStats *stats) {
+        current_ = stats;
+    }
+
+    // Run a callback of the application, its time counts for the loop of the calling thread
+    template<typename F>
+    static inline void Measure(F &&callback) {
+        auto stats = current_;
+        if (!stats) {
+            callback();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        callback();
+        stats->callbackNs.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    static thread_local LoopStats *current_;
+};
+
+// Snapshot of every event loop of a server
+struct ServerStats {
+    struct Loop {
+        int8_t thread;// index of the ThreadManager
+        bool write;// the write loop of a ThreadManager with read/write separation
+        LoopStatsSnapshot stats;
+    };
+
+    std::vector<Loop> loops;
+
+    // Sum over all loops
+    LoopStatsSnapshot Total() const;
+
+    // Prometheus text exposition format, one sample per loop labelled with thread and loop="read"|"write"
+    std::string ToPrometheus(const std::string &prefix = "netevent") const;
+};
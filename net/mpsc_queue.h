@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+// Lock-free multi-producer single-consumer queue. A producer pushes with one CAS,
+// the consumer takes everything pushed so far with one exchange
+template<typename T>
+class MpscQueue {
+public:
+    MpscQueue() = default;
+
+    ~MpscQueue();
+
+    MpscQueue(const MpscQueue &) = delete;
+
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // Return true when the queue was empty, the consumer may need a wakeup then
+    bool Push(T &&value);
+
+    // Call func with every value pushed so far, in push order
+    template<typename F>
+    void Consume(F &&func);
+
+private:
+    struct Node {
+        T value;
+        Node *next;
+    };
+
+    std::atomic<Node *> head_ = nullptr;
+};
+
+template<typename T>
+MpscQueue<T>::~MpscQueue() {
+    auto node = head_.load();
+    while (node) {
+        auto next = node->next;
+        delete node;
+        node = next;
+    }
+}
+
+template<typename T>
+bool MpscQueue<T>::Push(T &&value) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto node = new Node{std::move(value), head};
+    while (!head_.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed)) {
+        node->next = head;
+    }
+    // the node may be consumed already, only the local copy of the old head is safe to read
+    return head == nullptr;
+}
+
+template<typename T>
+template<typename F>
+void MpscQueue<T>::Consume(F &&func) {
+    auto node = head_.exchange(nullptr, std::memory_order_acquire);
+    // The list is newest first, reverse it into push order
+    Node *ordered = nullptr;
+    while (node) {
+        auto next = node->next;
+        node->next = ordered;
+        ordered = node;
+        node = next;
+    }
+    while (ordered) {
+        auto next = ordered->next;
+        func(std::move(ordered->value));
+        delete ordered;
+        ordered = next;
+    }
+}
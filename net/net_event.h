@@ -37,6 +37,11 @@ public:
 
     virtual void OnError() = 0;
 
+    // The peer ended the stream, noticed by OnReadable. The connection is closed once the data before it is handled
+    virtual bool PeerClosed() const {
+        return false;
+    }
+
     // Send data
     virtual bool SendPacket(std::string &&msg) = 0;
 
@@ -0,0 +1,108 @@
+#include <unistd.h>
+#include <cerrno>
+
+#include "send_queue.h"
+
+FileSegment &FileSegment::operator=(FileSegment &&other) noexcept {
+    if (this != &other) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        fd = std::exchange(other.fd, -1);
+        offset = other.offset;
+        length = other.length;
+    }
+    return *this;
+}
+
+FileSegment::~FileSegment() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool FileSegment::Read(std::string *data) const {
+    data->resize(length);
+    size_t done = 0;
+    while (done < length) {
+        auto n = ::pread(fd, data->data() + done, length - done, offset + static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {// the file ends before the segment
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+void SendQueue::Append(std::string &&msg) {
+    if (msg.empty()) {
+        return;
+    }
+    size_ += msg.size();
+    buffers_.push_back({std::move(msg), FileSegment()});
+}
+
+void SendQueue::Append(FileSegment &&file) {
+    if (file.length == 0) {
+        return;
+    }
+    size_ += file.length;
+    buffers_.push_back({std::string(), std::move(file)});
+}
+
+int SendQueue::Fill(struct iovec *iov, int max) const {
+    int count = 0;
+    size_t pos = pos_;
+    for (auto iter = buffers_.begin(); iter != buffers_.end() && count < max; ++iter, ++count) {
+        if (iter->file.Valid()) {
+            break;
+        }
+        iov[count].iov_base = const_cast<char *>(iter->data.data()) + pos;
+        iov[count].iov_len = iter->data.size() - pos;
+        pos = 0;
+    }
+    return count;
+}
+
+void SendQueue::Consume(size_t n, std::vector<std::string> *released) {
+    size_ -= n;
+    while (n > 0) {
+        auto &front = buffers_.front();
+        if (front.file.Valid()) {// the segment shrinks to what is left of it
+            if (n < front.file.length) {
+                front.file.offset += static_cast<off_t>(n);
+                front.file.length -= n;
+                return;
+            }
+            n -= front.file.length;
+            buffers_.pop_front();
+            continue;
+        }
+        auto left = front.data.size() - pos_;
+        if (n < left) {
+            pos_ += n;
+            return;
+        }
+        n -= left;
+        pos_ = 0;
+        if (released) {
+            released->emplace_back(std::move(front.data));
+        }
+        buffers_.pop_front();
+    }
+}
+
+void SendQueue::Clear() {
+    buffers_.clear();
+    pos_ = 0;
+    size_ = 0;
+}
+
+void SendQueue::Swap(SendQueue &other) {
+    buffers_.swap(other.buffers_);
+    std::swap(pos_, other.pos_);
+    std::swap(size_, other.size_);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "block_pool.h"
+
+// A segment of a file to send. The fd is owned, it is closed with the segment
+struct FileSegment {
+    FileSegment() = default;
+
+    FileSegment(int fd, off_t offset, size_t length) : fd(fd), offset(offset), length(length) {}
+
+    FileSegment(FileSegment &&other) noexcept
+            : fd(std::exchange(other.fd, -1)), offset(other.offset), length(other.length) {}
+
+    FileSegment &operator=(FileSegment &&other) noexcept;
+
+    ~FileSegment();
+
+    inline bool Valid() const {
+        return fd >= 0;
+    }
+
+    // Read the whole segment into data, for the paths that can only send memory
+    bool Read(std::string *data) const;
+
+    int fd = -1;
+    off_t offset = 0;
+    size_t length = 0;
+};
+
+// Outgoing data of a connection. Messages are queued as the buffers they arrived in
+// and written with one writev/sendmsg instead of being copied into a single buffer.
+// File segments keep their place between the messages and are sent from the file
+class SendQueue {
+public:
+    // Queue the message, it is moved, not copied
+    void Append(std::string &&msg);
+
+    // Queue the file segment
+    void Append(FileSegment &&file);
+
+    // Point iov at the unsent data, at most max segments and up to the next file segment.
+    // Return the number of segments
+    int Fill(struct iovec *iov, int max) const;
+
+    // The file segment at the front, the unsent part of it. nullptr when the front is in memory
+    inline const FileSegment *FrontFile() const {
+        return !buffers_.empty() && buffers_.front().file.Valid() ? &buffers_.front().file : nullptr;
+    }
+
+    // Drop n sent bytes from the front. The buffers sent completely are moved to released
+    // when it is given, for data that the kernel may still read after the send returned
+    void Consume(size_t n, std::vector<std::string> *released = nullptr);
+
+    void Clear();
+
+    void Swap(SendQueue &other);
+
+    // Bytes not sent yet
+    inline size_t Size() const {
+        return size_;
+    }
+
+    // Buffers not sent yet
+    inline size_t Count() const {
+        return buffers_.size();
+    }
+
+    inline bool Empty() const {
+        return size_ == 0;
+    }
+
+private:
+    struct Buffer {
+        std::string data;
+        FileSegment file;// sent instead of data when valid
+    };
+
+    std::deque<Buffer, PoolAllocator<Buffer>> buffers_;
+    size_t pos_ = 0;//sent bytes of the front buffer
+    size_t size_ = 0;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Chase-Lev work-stealing deque of pointers. The owner thread pushes and pops at the bottom,
+// any other thread steals from the top. Neither side takes a lock, only the last item is
+// contended, with one CAS. The ring grows when full, the old rings are kept for thieves
+// that may still read them until the deque is destroyed
+template<typename T>
+class StealDeque {
+public:
+    StealDeque();
+
+    StealDeque(const StealDeque &) = delete;
+
+    StealDeque &operator=(const StealDeque &) = delete;
+
+    // Owner only
+    void Push(T *item);
+
+    // Owner only, the newest item or nullptr
+    T *Pop();
+
+    // Any thread, the oldest item or nullptr when empty or another thread took it first
+    T *Steal();
+
+private:
+    struct Ring {
+        explicit Ring(int64_t capacity) : mask(capacity - 1), slots(new std::atomic<T *>[capacity]) {}
+
+        inline T *Get(int64_t index) const {
+            return slots[index & mask].load(std::memory_order_relaxed);
+        }
+
+        inline void Put(int64_t index, T *item) {
+            slots[index & mask].store(item, std::memory_order_relaxed);
+        }
+
+        const int64_t mask;
+        std::unique_ptr<std::atomic<T *>[]> slots;
+    };
+
+    // Owner only, double the ring when it is full
+    Ring *Grow(Ring *ring, int64_t top, int64_t bottom);
+
+    static constexpr int64_t initialCapacity_ = 64;
+
+    alignas(64) std::atomic<int64_t> top_ = 0;
+    alignas(64) std::atomic<int64_t> bottom_ = 0;
+    std::atomic<Ring *> ring_;
+    std::vector<std::unique_ptr<Ring>> rings_;// every ring ever used, owner only
+};
+
+template<typename T>
+StealDeque<T>::StealDeque() {
+    rings_.push_back(std::make_unique<Ring>(initialCapacity_));
+    ring_.store(rings_.back().get(), std::memory_order_relaxed);
+}
+
+template<typename T>
+void StealDeque<T>::Push(T *item) {
+    auto bottom = bottom_.load(std::memory_order_relaxed);
+    auto top = top_.load(std::memory_order_acquire);
+    auto ring = ring_.load(std::memory_order_relaxed);
+    if (bottom - top > ring->mask) {
+        ring = Grow(ring, top, bottom);
+    }
+    ring->Put(bottom, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+}
+
+template<typename T>
+T *StealDeque<T>::Pop() {
+    auto bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    auto ring = ring_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    // Orders the claim of the bottom item before the look at the top, a thief does the opposite
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {// empty
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    auto item = ring->Get(bottom);
+    if (top == bottom) {// the last item, a thief may want it as well
+        if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            item = nullptr;
+        }
+        bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return item;
+}
+
+template<typename T>
+T *StealDeque<T>::Steal() {
+    auto top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) {
+        return nullptr;
+    }
+    auto item = ring_.load(std::memory_order_acquire)->Get(top);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    return item;
+}
+
+template<typename T>
+typename StealDeque<T>::Ring *StealDeque<T>::Grow(Ring *ring, int64_t top, int64_t bottom) {
+    auto bigger = std::make_unique<Ring>((ring->mask + 1) * 2);
+    for (auto i = top; i < bottom; ++i) {
+        bigger->Put(i, ring->Get(i));
+    }
+    ring = bigger.get();
+    rings_.push_back(std::move(bigger));
+    ring_.store(ring, std::memory_order_release);
+    return ring;
+}
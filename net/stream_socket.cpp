@@ -1,51 +1,425 @@
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+#include "config.h"
 #include "stream_socket.h"
 
+#ifdef HAVE_MSG_ZEROCOPY
+
+#include <linux/errqueue.h>
+
+#endif
+
+#ifdef HAVE_SENDFILE
+
+#include <sys/sendfile.h>
+
+#endif
+
+// Count an IO syscall for the loop of the calling thread
+static void CountIo(LoopCounter LoopStats::*calls, LoopCounter LoopStats::*bytes, ssize_t ret) {
+    if (auto stats = LoopStats::Current()) {
+        (stats->*calls).Add(1);
+        if (ret > 0) {
+            (stats->*bytes).Add(ret);
+        }
+    }
+}
+
+std::unique_ptr<StreamSocket> StreamSocket::Connect(const SocketAddr &addr) {
+    int fd = CreateTCPSocket(addr.Family());
+    if (fd < 0) {
+        return nullptr;
+    }
+    auto socket = std::make_unique<StreamSocket>(fd, SOCKET_TCP);
+    socket->SetNonBlock(true);
+    socket->OnCreate();
+    if (::connect(fd, addr.Data(), addr.Length()) != 0 && errno != EINPROGRESS) {
+        int err = errno;
+        socket->Close();
+        errno = err;
+        return nullptr;
+    }
+    return socket;
+}
+
+int StreamSocket::ConnectResult() {
+    int err = 0;
+    socklen_t length = sizeof(err);
+    if (::getsockopt(Fd(), SOL_SOCKET, SO_ERROR, &err, &length) != 0) {
+        return errno;
+    }
+    if (err != 0) {
+        return err;
+    }
+    // Not failed does not mean finished yet
+    sockaddr_storage peer{};
+    length = sizeof(peer);
+    if (::getpeername(Fd(), reinterpret_cast<sockaddr *>(&peer), &length) != 0) {
+        return errno;
+    }
+    return 0;
+}
+
 int StreamSocket::OnReadable(const std::shared_ptr<Connection> &conn, std::string *readBuff) {
     return Read(readBuff);
 }
 
 //return bytes that have not yet been sent
 int StreamSocket::OnWritable() {
+    int ret;
+    int crossed;
+    {
+        std::lock_guard<std::mutex> lock(sendMutex_);
+        writable_ = true;
+        ret = Flush();
+        crossed = OnSendChanged();
+    }
+    NotifyWatermark(crossed);
+    return ret;
+}
+
+bool StreamSocket::SendPacket(std::string &&msg) {
+    int ret = 0;
+    int crossed;
+    {
+        std::lock_guard<std::mutex> lock(sendMutex_);
+        sendQueue_.Append(std::move(msg));
+        if (edgeTrigger_ && writable_) {// no EPOLLOUT edge comes while the socket is writable, send now
+            ret = Flush();
+        }
+        crossed = OnSendChanged();
+    }
+    NotifyWatermark(crossed);
+    return ret != NE_ERROR;
+}
+
+template<typename Item>
+int StreamSocket::Enqueue(Item &&item) {
+    int ret;
+    int crossed;
+    {
+        std::lock_guard<std::mutex> lock(sendMutex_);
+        bool idle = sendQueue_.Empty();
+        sendQueue_.Append(std::forward<Item>(item));
+        if (!idle || (edgeTrigger_ && !writable_)) {// the queued data goes out first
+            ret = static_cast<int>(std::min<size_t>(sendQueue_.Size(), INT_MAX));
+        } else {
+            ret = Flush();
+        }
+        crossed = OnSendChanged();
+    }
+    NotifyWatermark(crossed);
+    return ret;
+}
+
+int StreamSocket::WriteThrough(std::string &&msg) {
+    return Enqueue(std::move(msg));
+}
+
+int StreamSocket::WriteThrough(FileSegment &&file) {
+    return Enqueue(std::move(file));
+}
+
+int StreamSocket::Flush() {
+    struct iovec iov[IOV_MAX];
+    bool copy = false;// the kernel ran out of memory to pin pages, copy this time
+    while (!sendQueue_.Empty()) {
+        ssize_t ret;
+        bool zeroCopy = false;
+        if (auto file = sendQueue_.FrontFile()) {
+            ret = SendFront(*file);
+        } else {
+            struct msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = sendQueue_.Fill(iov, IOV_MAX);
+            int flags = MSG_NOSIGNAL;
+#ifdef HAVE_MSG_ZEROCOPY
+            zeroCopy = !copy && zeroCopyThreshold_ > 0 && sendQueue_.Size() >= zeroCopyThreshold_;
+            if (zeroCopy) {
+                flags |= MSG_ZEROCOPY;
+            }
+#endif
+            ret = ::sendmsg(Fd(), &msg, flags);
+        }
+        CountIo(&LoopStats::writes, &LoopStats::bytesWritten, ret);
+        if (ret == -1) {
+            if (EINTR == errno) {
+                continue;
+            }
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                writable_ = false;
+                break;
+            }
+            if (zeroCopy && ENOBUFS == errno) {
+                copy = true;
+                continue;
+            }
+            return NE_ERROR;
+        }
+        std::vector<std::string> *held = nullptr;
+        if (zeroCopy) {
+            zeroCopySends_.push_back({zeroCopyNext_++, false, {}});
+        }
+        if (!zeroCopySends_.empty()) {// the kernel may still read them
+            held = &zeroCopySends_.back().buffers;
+        }
+        sendQueue_.Consume(ret, held);
+        if (!edgeTrigger_) {// level-triggered, the next EPOLLOUT continues
+            break;
+        }
+    }
+    return static_cast<int>(std::min<size_t>(sendQueue_.Size(), INT_MAX));
+}
+
+ssize_t StreamSocket::SendFront(const FileSegment &file) {
+    static constexpr size_t chunk = 1024 * 1024;// per call, so that one file does not hold the loop
+#ifdef HAVE_SENDFILE
+    off_t offset = file.offset;
+    auto ret = ::sendfile(Fd(), file.fd, &offset, std::min(file.length, chunk));
+#else
+    char buff[16 * 1024];
+    auto ret = ::pread(file.fd, buff, std::min(file.length, sizeof(buff)), file.offset);
+    if (ret > 0) {// what the socket does not take is read again next time
+        ret = ::send(Fd(), buff, ret, MSG_NOSIGNAL);
+    }
+#endif
+    if (ret == 0) {// the file ends before the segment, the peer would wait for the rest forever
+        errno = EIO;
+        return -1;
+    }
+    return ret;
+}
+
+bool StreamSocket::TakeSendData(SendQueue *data) {
     std::lock_guard<std::mutex> lock(sendMutex_);
-    size_t ret = ::write(Fd(), sendData_.c_str() + sendPos_, sendData_.size() - sendPos_);
-    if (ret == -1) {
-        return NE_ERROR;
+    if (sendQueue_.Empty()) {
+        return false;
     }
-    sendPos_ += ret;
-    if (sendPos_ == sendData_.size()) {
-        sendPos_ = 0;
-        sendData_.clear();
-        return 0;
+    data->Clear();
+    data->Swap(sendQueue_);
+    inFlight_ += data->Size();
+    return true;
+}
+
+void StreamSocket::OnSent(size_t n) {
+    int crossed;
+    {
+        std::lock_guard<std::mutex> lock(sendMutex_);
+        inFlight_ -= std::min(n, inFlight_);
+        crossed = OnSendChanged();
     }
-    return static_cast<int>(sendData_.size() - sendPos_);
+    NotifyWatermark(crossed);
 }
 
-bool StreamSocket::SendPacket(std::string &&msg) {
+bool StreamSocket::EnableZeroCopy(size_t threshold) {
+#ifdef HAVE_MSG_ZEROCOPY
+    int on = 1;
+    if (::setsockopt(Fd(), SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+        return false;
+    }
     std::lock_guard<std::mutex> lock(sendMutex_);
-    sendData_.append(msg);
+    zeroCopyThreshold_ = threshold;
     return true;
+#else
+    return false;
+#endif
+}
+
+int StreamSocket::OnErrorQueue() {
+#ifdef HAVE_MSG_ZEROCOPY
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    char control[128];
+    while (true) {
+        struct msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(Fd(), &msg, MSG_ERRQUEUE) == -1) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;// EAGAIN once it is drained
+        }
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err err{};
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                return NE_ERROR;
+            }
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // The route copies anyway, loopback for one, the notifications are pure overhead then
+                zeroCopyThreshold_ = 0;
+            }
+            OnZeroCopyDone(err.ee_info, err.ee_data);
+        }
+    }
+#endif
+    int err = 0;
+    socklen_t length = sizeof(err);
+    if (::getsockopt(Fd(), SOL_SOCKET, SO_ERROR, &err, &length) != 0 || err != 0) {
+        return NE_ERROR;
+    }
+    return NE_OK;
+}
+
+void StreamSocket::OnZeroCopyDone(uint32_t first, uint32_t last) {
+    for (auto &send: zeroCopySends_) {
+        if (send.id - first <= last - first) {// the ids wrap around
+            send.done = true;
+        }
+    }
+    while (!zeroCopySends_.empty() && zeroCopySends_.front().done) {
+        zeroCopySends_.pop_front();
+    }
+}
+
+void StreamSocket::SetWatermarks(size_t high, size_t low,
+                                 std::function<void(bool high, size_t pending)> &&onWatermark) {
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    highWatermark_ = high;
+    lowWatermark_ = std::min(low, high);
+    onWatermark_ = std::move(onWatermark);
+}
+
+bool StreamSocket::AboveHighWatermark() {
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    return aboveHigh_;
+}
+
+size_t StreamSocket::Pending() {
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    return sendQueue_.Size() + inFlight_;
+}
+
+void StreamSocket::SetPendingGauge(std::atomic<int64_t> *gauge) {
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    pendingGauge_ = gauge;
+}
+
+void StreamSocket::Close() {
+    BaseSocket::Close();
+    std::lock_guard<std::mutex> lock(sendMutex_);
+    OnSendChanged();
+}
+
+int StreamSocket::OnSendChanged() {
+    auto pending = sendQueue_.Size() + inFlight_;
+    if (pendingGauge_) {
+        auto accounted = Fd() < 0 ? 0 : pending;// whatever a closed socket keeps is never sent
+        if (accounted != accounted_) {
+            pendingGauge_->fetch_add(static_cast<int64_t>(accounted) - static_cast<int64_t>(accounted_),
+                                     std::memory_order_relaxed);
+            accounted_ = accounted;
+        }
+    }
+
+    if (highWatermark_ == 0) {
+        return 0;
+    }
+    if (!aboveHigh_ && pending >= highWatermark_) {
+        aboveHigh_ = true;
+        return 1;
+    }
+    if (aboveHigh_ && pending <= lowWatermark_) {
+        aboveHigh_ = false;
+        return -1;
+    }
+    return 0;
+}
+
+void StreamSocket::NotifyWatermark(int crossed) {
+    if (crossed != 0 && onWatermark_) {
+        size_t pending;
+        {
+            std::lock_guard<std::mutex> lock(sendMutex_);
+            pending = sendQueue_.Size() + inFlight_;
+        }
+        onWatermark_(crossed > 0, pending);
+    }
+}
+
+// Set the size of the string without writing the new bytes, where the library allows it
+static inline void GrowUninitialized(std::string *s, size_t size) {
+#ifdef __cpp_lib_string_resize_and_overwrite
+    s->resize_and_overwrite(size, [](char *, size_t n) { return n; });
+#else
+    s->resize(size);
+#endif
+}
+
+// What a string holds without a heap buffer
+static const size_t smallCapacity = std::string().capacity();
+
+// Takes the part of a read that does not fit in the string, one per thread
+static char *SpillBuffer(size_t size) {
+    thread_local std::unique_ptr<char[]> spill(new char[size]);
+    return spill.get();
 }
 
 // Read data from the socket
 int StreamSocket::Read(std::string *readBuff) {
-    char readBuffer[readBuffSize_];
+    auto spill = SpillBuffer(maxReadHint_);
+    // Only a string that comes with a heap buffer is kept by the caller and grows to the hint, any other
+    // one is handed on with the data and takes just what was read, also on the reads that follow
+    if (readBuff->capacity() > smallCapacity) {
+        readBuff->reserve(readBuff->size() + readHint_);
+    }
     while (true) {
-        int ret = static_cast<int>(::read(Fd(), readBuffer, readBuffSize_));
-        if (ret == -1) {
-            if (EAGAIN == errno || EWOULDBLOCK == errno || ECONNRESET == errno) {
+        auto size = readBuff->size();
+        size_t room = readBuff->capacity() - size;
+        GrowUninitialized(readBuff, size + room);
+        struct iovec iov[2] = {{readBuff->data() + size, room}, {spill, maxReadHint_}};
+        auto ret = ::readv(Fd(), iov, 2);
+        CountIo(&LoopStats::reads, &LoopStats::bytesRead, ret);
+        if (ret <= 0) {
+            readBuff->resize(size);
+            if (ret == 0 || ECONNRESET == errno) {// the data before it is returned, the caller closes
+                peerClosed_ = true;
+                return NE_OK;
+            }
+            if (EINTR == errno) {
+                continue;
+            }
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
                 return NE_OK;
-            } else {
-                return NE_ERROR;
             }
+            return NE_ERROR;
         }
-        if (!NoBlock() || ret == 0) {
-            break;
+        auto n = static_cast<size_t>(ret);
+        if (n <= room) {
+            readBuff->resize(size + n);
+        } else {// only the part beyond the free space is copied
+            readBuff->append(spill, n - room);
         }
-        if (ret > 0) {
-            readBuff->append(readBuffer, ret);
+        AdaptReadHint(n);
+        if (!NoBlock()) {
+            break;
         }
     }
 
     return NE_OK;
 }
+
+void StreamSocket::AdaptReadHint(size_t n) {
+    if (n >= readHint_) {
+        smallReads_ = 0;
+        size_t hint = readHint_ * 2;
+        while (hint < n && hint < maxReadHint_) {
+            hint *= 2;
+        }
+        readHint_ = static_cast<uint32_t>(std::min(hint, maxReadHint_));
+    } else if (n < readHint_ / 4 && readHint_ > minReadHint_) {
+        if (++smallReads_ >= smallReadsToShrink_) {
+            smallReads_ = 0;
+            readHint_ /= 2;
+        }
+    } else {
+        smallReads_ = 0;
+    }
+}
@@ -4,10 +4,13 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <mutex>
 
 #include "base_socket.h"
+#include "send_queue.h"
 
 class StreamSocket : public BaseSocket {
 
@@ -18,19 +21,147 @@ public:
 
     int Init() override { return 1; };
 
+    // Sockets come from the pool of the IO thread that accepts them, see BlockPool
+    static void *operator new(size_t size) {
+        return BlockPool::Allocate(size);
+    }
+
+    static void operator delete(void *p) {
+        BlockPool::Deallocate(p);
+    }
+
+    // Open a socket and start a non-blocking connect to the address.
+    // Return nullptr with errno set when the connect fails right away
+    static std::unique_ptr<StreamSocket> Connect(const SocketAddr &addr);
+
+    // Outcome of the connect once the socket is writable: 0 when connected, the errno otherwise
+    int ConnectResult();
+
     int OnReadable(const std::shared_ptr<Connection> &conn, std::string *readBuff) override;
 
     int OnWritable() override;
 
     bool SendPacket(std::string &&msg) override;
 
+    // Write the message right away when nothing is queued before it, queue what the socket
+    // does not take. Return NE_ERROR or the bytes left in the queue
+    int WriteThrough(std::string &&msg);
+
+    // Same for a file segment, which is sent with sendfile
+    int WriteThrough(FileSegment &&file);
+
+    // Move the unsent data out of the send queue, used by completion based
+    // multiplexes that keep the data alive until the kernel has sent it
+    bool TakeSendData(SendQueue *data);
+
+    // The kernel finished with n bytes of the data taken by TakeSendData
+    void OnSent(size_t n);
+
+    // Report when the unsent data rises to high or above, and when it falls to low or below
+    // after that. The callback gets whether high was crossed and runs without the send lock.
+    // high 0 disables the watermarks
+    void SetWatermarks(size_t high, size_t low, std::function<void(bool high, size_t pending)> &&onWatermark);
+
+    // Whether the unsent data crossed the high watermark and has not fallen to low yet
+    bool AboveHighWatermark();
+
+    // Bytes queued or handed to the kernel that it has not finished sending yet
+    size_t Pending();
+
+    // Send with MSG_ZEROCOPY while at least threshold bytes are queued. The kernel then reads
+    // the buffers in place and they are kept until it reports the completion on the error queue.
+    // Return false when the socket does not support it
+    bool EnableZeroCopy(size_t threshold);
+
+    // Handle the error queue when the socket reports an error: release the buffers of the
+    // finished zero-copy sends. Return NE_ERROR when the socket has a real error
+    int OnErrorQueue();
+
+    // Keep the unsent bytes of the socket added to the gauge until it is closed
+    void SetPendingGauge(std::atomic<int64_t> *gauge);
+
+    void Close() override;
+
+    // Append what the socket has to readBuff. The data is read straight into the free space of the
+    // string, a string that already has a heap buffer is kept by the caller and first grows to what the
+    // reads of this connection usually bring. The rest of a read comes from a buffer of the thread and
+    // is appended at its size. At the end of the stream the data before it is returned and PeerClosed is set
     int Read(std::string *readBuff);
 
+    // The peer closed or reset the connection, noticed by Read
+    inline bool PeerClosed() const override {
+        return peerClosed_;
+    }
+
+    // Bytes a read is expected to bring, a power of two that follows the observed reads
+    inline size_t ReadHint() const {
+        return readHint_;
+    }
+
+    // In edge-triggered mode the socket is registered for write readiness once,
+    // whether it can take more data is tracked here instead of in the epoll interest
+    inline void SetEdgeTrigger(bool edge = true) {
+        edgeTrigger_ = edge;
+    }
+
 private:
-    const int readBuffSize_ = 4 * 1024;//read from socket buff size 4K
+    // Write the buffered data, until EAGAIN in edge-triggered mode.
+    // Return NE_ERROR or the bytes not sent yet, sendMutex_ must be held
+    int Flush();
+
+    // Queue the message or file segment and write it unless data is queued before it
+    template<typename Item>
+    int Enqueue(Item &&item);
+
+    // Send from the file segment at the front of the queue. Return the bytes sent or -1 with errno set
+    ssize_t SendFront(const FileSegment &file);
+
+    // The unsent data changed, sendMutex_ must be held. Update the pending gauge and check the watermarks,
+    // return 1 when high was crossed, -1 when low was crossed, 0 otherwise
+    int OnSendChanged();
+
+    void NotifyWatermark(int crossed);
+
+    // The kernel finished the zero-copy sends first to last, sendMutex_ must be held
+    void OnZeroCopyDone(uint32_t first, uint32_t last);
+
+    // A zero-copy send and the buffers it may still read, the buffers sent completely while it was
+    // running are kept with the newest one so that they are released after every earlier send
+    struct ZeroCopySend {
+        uint32_t id;
+        bool done;
+        std::vector<std::string> buffers;
+    };
+
+    // Adapt the read hint to a read of n bytes: it grows to a read that filled it at once
+    // and halves after smallReadsToShrink_ reads in a row that used less than a quarter
+    void AdaptReadHint(size_t n);
+
+    static constexpr size_t minReadHint_ = 1024;
+    static constexpr size_t maxReadHint_ = 64 * 1024;// also the size of the spill buffer of the thread
+    static constexpr uint8_t smallReadsToShrink_ = 8;
+
+    uint32_t readHint_ = 4 * 1024;//bytes reserved in a kept string for the next read
+    uint8_t smallReads_ = 0;//reads in a row below a quarter of the hint
+    bool peerClosed_ = false;
 
     std::mutex sendMutex_;//send data buff mutex
 
-    std::string sendData_;//send data buff
-    size_t sendPos_ = 0;//send data buff pos
+    SendQueue sendQueue_;//send data buffs
+
+    size_t zeroCopyThreshold_ = 0;//queued bytes from which sends use MSG_ZEROCOPY, 0 disables it
+    uint32_t zeroCopyNext_ = 0;//id the kernel gives the next zero-copy send
+    std::deque<ZeroCopySend, PoolAllocator<ZeroCopySend>> zeroCopySends_;//sends the kernel has not reported yet, oldest first
+    size_t inFlight_ = 0;//taken by TakeSendData and not sent yet
+
+    size_t highWatermark_ = 0;
+    size_t lowWatermark_ = 0;
+    bool aboveHigh_ = false;
+    std::function<void(bool high, size_t pending)> onWatermark_;
+
+    std::atomic<int64_t> *pendingGauge_ = nullptr;
+    size_t accounted_ = 0;//unsent bytes added to the gauge
+
+    bool edgeTrigger_ = false;
+    bool writable_ = true;//edge-triggered only, false after EAGAIN until the next EPOLLOUT
 };
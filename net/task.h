@@ -0,0 +1,160 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "frame_pool.h"
+
+template<typename T = void>
+class Task;
+
+// Parts of the promise that do not depend on the result
+class TaskPromiseBase {
+public:
+    // Frames come from the pool of the thread instead of the heap
+    static void *operator new(size_t size) {
+        return FramePool::Allocate(size);
+    }
+
+    static void operator delete(void *frame, size_t size) {
+        FramePool::Deallocate(frame, size);
+    }
+
+    // Started when it is awaited, or by Task::Start
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+
+    // Continue the awaiting coroutine right away, symmetric transfer keeps the stack flat
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+            auto continuation = handle.promise().continuation_;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    // The library does not use exceptions, a coroutine must not let one escape
+    void unhandled_exception() noexcept {
+        std::terminate();
+    }
+
+    std::coroutine_handle<> continuation_;
+};
+
+template<typename T>
+class TaskPromise : public TaskPromiseBase {
+public:
+    Task<T> get_return_object() noexcept;
+
+    template<typename U>
+    void return_value(U &&value) {
+        value_.emplace(std::forward<U>(value));
+    }
+
+    T Result() {
+        return std::move(*value_);
+    }
+
+private:
+    std::optional<T> value_;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+    Task<void> get_return_object() noexcept;
+
+    void return_void() noexcept {}
+
+    void Result() {}
+};
+
+// A coroutine that returns a T. It starts when it is awaited, runs on the thread that awaits it
+// and resumes the awaiting coroutine where it finishes, there is no scheduler in between
+template<typename T>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    Task() = default;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    Task(Task &&other) noexcept: handle_(std::exchange(other.handle_, nullptr)) {}
+
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task &) = delete;
+
+    Task &operator=(const Task &) = delete;
+
+    // Destroys the coroutine, also one that is suspended and has not finished
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    auto operator co_await() const noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() noexcept {
+                return !handle || handle.done();
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation_ = awaiting;
+                return handle;
+            }
+
+            T await_resume() {
+                return handle.promise().Result();
+            }
+        };
+        return Awaiter{handle_};
+    }
+
+    // Run the task up to its first suspension without awaiting it.
+    // The Task has to stay alive until it is Done() or no longer needed
+    inline void Start() {
+        handle_.resume();
+    }
+
+    inline bool Done() const {
+        return !handle_ || handle_.done();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
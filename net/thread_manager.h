@@ -1,13 +1,23 @@
 #pragma once
 
+#include <fcntl.h>
 #include <atomic>
+#include <cstring>
+#include <deque>
 #include <memory>
 #include <unordered_map>
-#include <shared_mutex>
+#include <vector>
 #include <mutex>
 
 #include "io_thread.h"
 #include "callback_function.h"
+#include "co_connection.h"
+#include "codec.h"
+#include "stream_socket.h"
+#include "datagram_socket.h"
+#include "epoch.h"
+#include "fd_slab.h"
+#include "worker_pool.h"
 
 #include "config.h"
 
@@ -21,6 +31,12 @@
 
 #endif
 
+#if defined(HAVE_IO_URING)
+
+#include "uring_event.h"
+
+#endif
+
 template<typename T> requires HasSetFdFunction<T>
 class ThreadManager {
 public:
@@ -43,8 +59,104 @@ public:
         OnClose_ = func;
     }
 
-    // Start the thread and initialize the event
-    bool Start(const std::shared_ptr<NetEvent> &listen);
+    //set the callback function of received datagrams, UDP mode
+    inline void SetOnDatagram(const OnDatagram &func) {
+        OnDatagram_ = func;
+    }
+
+    //set the coroutine that serves each connection instead of OnMessage
+    inline void SetOnConnection(const CoHandler<T> &func) {
+        OnConnection_ = func;
+    }
+
+    //set the callback function when the unsent data crosses the high watermark
+    inline void SetOnHighWatermark(const OnHighWatermark<T> &func) {
+        OnHighWatermark_ = func;
+    }
+
+    // set the multiplexing type, BaseEvent::EVENT_TYPE_*
+    inline void SetEventType(int8_t type) {
+        eventType_ = type;
+    }
+
+    // use edge-triggered epoll
+    inline void SetEdgeTrigger(bool edge) {
+        edgeTrigger_ = edge;
+    }
+
+    // split the received data into frames, nullptr delivers every read as it is
+    inline void SetCodec(const std::shared_ptr<Codec> &codec) {
+        codec_ = codec;
+    }
+
+    // close connections that have not received anything for timeout ms, 0 disables it
+    inline void SetIdleTimeout(int64_t timeout) {
+        idleTimeout_ = timeout;
+    }
+
+    // limits of the unsent data per connection, high 0 disables them
+    inline void SetWatermarks(size_t high, size_t low, bool pauseReading) {
+        highWatermark_ = high;
+        lowWatermark_ = low;
+        pauseReading_ = pauseReading;
+    }
+
+    // run OnMessage on the worker pool instead of the read thread, nullptr keeps it on the read thread
+    inline void SetWorkerPool(const std::shared_ptr<WorkerPool> &workers) {
+        workers_ = workers;
+    }
+
+    // send with MSG_ZEROCOPY while a connection has at least threshold bytes queued, 0 disables it
+    inline void SetZeroCopy(size_t threshold) {
+        zeroCopyThreshold_ = threshold;
+    }
+
+    // idle outbound connections kept per address
+    inline void SetPoolSize(size_t size) {
+        poolSize_ = size;
+    }
+
+    // run the read and write threads on the cpu, -1 means no pinning
+    inline void SetCpu(int cpu) {
+        cpu_ = cpu;
+    }
+
+    // spin us in the loops before they block, and SO_BUSY_POLL us on the sockets, 0 disables each
+    inline void SetBusyPoll(int64_t spin, int socketPoll) {
+        busyPollSpin_ = spin;
+        busyPollSocket_ = socketPoll;
+    }
+
+    // Run the callback on the read thread after delay ms
+    inline uint64_t RunAfter(int64_t delay, std::function<void()> &&callback) {
+        return readThread_->RunTimer(delay, 0, std::move(callback));
+    }
+
+    // Run the callback on the read thread every interval ms
+    inline uint64_t RunEvery(int64_t interval, std::function<void()> &&callback) {
+        return readThread_->RunTimer(interval, interval, std::move(callback));
+    }
+
+    inline void CancelTimer(uint64_t id) {
+        readThread_->CancelTimer(id);
+    }
+
+    // Start the thread and initialize the event, it accepts on every listen socket
+    bool Start(const ListenSockets &listens);
+
+    // Connect to the address from the read thread, from any thread. The callback runs on the read thread
+    // with the new connection, or with nullptr when the connect failed or took longer than timeout ms (0 waits for the kernel)
+    void Connect(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback);
+
+    // Like Connect, but hand out an idle connection to the address from the pool when there is one
+    void Acquire(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback);
+
+    // Return an outbound connection to the pool, it is closed when the pool of its address is full
+    void Release(int fd);
+
+    // Start the read thread in UDP mode, it serves the datagram socket instead of connections.
+    // UDP always uses epoll or kqueue and has no write thread, the socket queues what it cannot send
+    bool StartDatagram(std::unique_ptr<DatagramSocket> socket);
 
     // Stop the thread
     void Stop();
@@ -53,44 +165,219 @@ public:
     void OnNetEventCreate(int fd, const std::shared_ptr<Connection> &conn);
 
     // Read message callback function
-    void OnNetEventMessage(int fd, std::string &&readData);
+    void OnNetEventMessage(Connection *conn, std::string &&readData);
 
-    // Close connection callback function
-    void OnNetEventClose(int fd, std::string &&err);
+    // Close connection callback function, runs on the read thread and hands it there from the others
+    void OnNetEventClose(Connection *conn, std::string &&err);
 
     // Server actively closes the connection
     void CloseConnection(int fd);
 
     void Wait();
 
-    // Send message to the client
+    // Send a datagram from the socket of this thread, from any thread.
+    // The loop flushes the datagrams queued in one round together
+    void SendTo(const SocketAddr &peer, std::string &&msg);
+
+    // Serve a connection accepted by the acceptor thread, from any thread
+    inline void Adopt(int fd) {
+        readThread_->Event()->PostAccept(fd);
+    }
+
+    // Open connections of the thread, and the ones handed over by Adopt that it has not served yet
+    inline int64_t Connections() const {
+        auto &event = readThread_->Event();
+        return event->Stats().connections.load(std::memory_order_relaxed) + event->PendingAccepts();
+    }
+
+    // Events the read loop has handled so far
+    inline uint64_t Events() const {
+        return readThread_->Event()->Stats().events.Get();
+    }
+
+    // Whether the caller runs on the read thread
+    inline bool InThread() const {
+        return readThread_ && readThread_->InThread();
+    }
+
+    // Add a snapshot of the counters of the read and write loops
+    void CollectStats(ServerStats *stats);
+
+    // Send message to the client. From the read thread the message is written directly,
+    // other threads post it to the thread that sends for the connection
     void SendPacket(const T &conn, std::string &&msg);
 
+    // Send length bytes of the file from offset, in order with the messages. The fd is duplicated,
+    // the caller may close its own. Return false when the connection is gone or the fd cannot be used
+    bool SendFile(const T &conn, int fd, off_t offset, size_t length);
+
 private:
     // Create read thread
-    bool CreateReadThread(const std::shared_ptr<NetEvent> &listen);
+    bool CreateReadThread(const ListenSockets &listens);
 
     // Create write thread if rwSeparation_ is true
     bool CreateWriteThread();
 
+    // Create the multiplex of eventType_, falls back to the platform default
+    // when the requested type is not available
+    std::shared_ptr<BaseEvent> CreateEvent(const ListenSockets &listens, int8_t mode);
+
+    // Get connection by fd
+    std::shared_ptr<Connection> GetConn(int fd);
+
+    // Check the connection when the idle timeout may have passed, read thread only.
+    // The timer holds no reference, a closed connection is simply gone
+    void ArmIdleTimer(const std::shared_ptr<Connection> &conn, int64_t delay);
+
+    // A direct send emptied the queue of a connection whose peer has finished, close it at the
+    // end of the round rather than under the caller. Read thread only
+    void CloseAfterSend(const std::shared_ptr<Connection> &conn);
+
+    // Wait for write readiness for the remainder of a write through. Only the sending thread
+    // changes the interest of its multiplex, another one hands it an empty message to flush and arm
+    void ArmWrite(const std::shared_ptr<Connection> &conn);
+
+    void OnIdleTimer(const std::weak_ptr<Connection> &weakConn);
+
+    // The unsent data of the connection crossed a watermark, on the thread that changed it.
+    // Reading is paused and resumed by the read thread, which checks the current state
+    void OnWatermark(Connection *conn, bool high, size_t pending);
+
+    // Open the socket and wait for the connect, read thread only
+    void StartConnect(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback);
+
+    // The connect of an outbound connection finished, or it was given up
+    void OnNetEventConnect(Connection *conn);
+
+    void OnConnectTimeout(int fd, Connection *conn);
+
+    // Send the queued datagrams, and wait for write readiness when the socket buffer is full. Read thread only
+    void FlushDatagrams();
+
+    // Deliver every complete frame of the data, keep the rest in the connection for the next read
+    void DecodeFrames(Connection *conn, std::string &&data);
+
+    // Hand a message to OnMessage, or to the coroutine of the connection in coroutine mode
+    void Deliver(Connection *conn, std::string &&msg);
+
+private:
+    // The messages of one connection waiting for the worker pool. It is queued to the pool when a message
+    // arrives while none is pending and runs them in order, so they never run concurrently
+    struct Strand : public PoolTask {
+        ThreadManager *manager = nullptr;
+        std::shared_ptr<Connection> conn;
+        MpscQueue<std::string> messages;
+        std::atomic<size_t> pending = 0;// counted before the push, the worker handles at most this many
+        std::shared_ptr<Strand> self;// keeps it alive while it is queued, the connection may be released meanwhile
+
+        void Run() override {
+            manager->RunStrand(this);
+        }
+    };
+
+    // Handle the pending messages of the connection on a worker
+    void RunStrand(Strand *strand);
+
+private:
+    // A connection and the user object bound to it, Connection::context_ points here
+    struct ConnEntry {
+        T t;
+        std::shared_ptr<Connection> conn;
+        SocketAddr upstream;// the address an outbound connection was made to, empty for accepted ones
+        std::unique_ptr<CoConnection<T>> co;// coroutine mode only
+        std::shared_ptr<Strand> strand;// with a worker pool only
+
+        // From the pool of the read thread, it may be reclaimed on another one.
+        // An over-aligned T goes to the heap
+        static void *operator new(size_t size) {
+            return BlockPool::Allocate(size);
+        }
+
+        static void operator delete(void *p) {
+            BlockPool::Deallocate(p);
+        }
+
+        static void *operator new(size_t size, std::align_val_t align) {
+            return ::operator new(size, align);
+        }
+
+        static void operator delete(void *p, std::align_val_t align) {
+            ::operator delete(p, align);
+        }
+    };
+
+    // An outbound connection waiting for its connect
+    struct PendingConnect {
+        std::shared_ptr<Connection> conn;
+        SocketAddr addr;
+        OnConnect<T> callback;
+        uint64_t timer = 0;
+    };
+
+    // A closed connection waiting for the event loops to finish the rounds that may still report it
+    // and for the other threads to leave the epoch in which they may have looked it up
+    struct RetiredEntry {
+        std::unique_ptr<ConnEntry> entry;
+        uint64_t readGeneration;
+        uint64_t writeGeneration;
+        uint64_t epoch;
+    };
+
+    // Keep the closed connection until nobody can reach it anymore,
+    // and release the ones that are safe by now
+    void Retire(std::unique_ptr<ConnEntry> &&entry);
+
 private:
     const bool rwSeparation_ = true; // Whether to separate read and write threads
     const int8_t index_ = 0; // The index of the thread
+    int8_t eventType_ = 0; // The multiplexing type, 0 means the platform default
+    bool edgeTrigger_ = false; // Whether epoll is edge-triggered
+    int64_t idleTimeout_ = 0; // Idle connections are closed after this many ms, 0 means never
+    std::shared_ptr<Codec> codec_; // Splits the received data into frames
+    size_t highWatermark_ = 0; // Unsent bytes per connection that trigger OnHighWatermark, 0 means no limit
+    size_t lowWatermark_ = 0; // Unsent bytes at which reading resumes
+    bool pauseReading_ = true; // Whether reading stops above the high watermark
+    int cpu_ = -1; // The cpu the threads are pinned to, -1 means none
+    size_t zeroCopyThreshold_ = 0; // Queued bytes from which sends use MSG_ZEROCOPY, 0 means never
+    int64_t busyPollSpin_ = 0; // us the loops poll without blocking after their last events
+    int busyPollSocket_ = 0; // SO_BUSY_POLL of the sockets in us
+    std::shared_ptr<WorkerPool> workers_; // Runs OnMessage when set, shared by the threads of the server
     std::atomic<bool> running_ = true; // Whether the thread is running
 
     std::unique_ptr<IOThread> readThread_; // Read thread
     std::unique_ptr<IOThread> writeThread_; // Write thread
 
-    // All connections for the current thread
-    std::unordered_map<int, std::pair<T, std::shared_ptr<Connection>>> connections_;
+    // Outbound connections waiting for their connect by fd, read thread only
+    std::unordered_map<int, PendingConnect> connecting_;
+
+    // Idle outbound connections by address, read thread only. A connection closed while it waits is skipped
+    std::unordered_map<SocketAddr, std::vector<std::weak_ptr<Connection>>> pool_;
+    size_t poolSize_ = 8; // Idle connections kept per address
 
-    std::shared_mutex mutex_;
+    std::shared_ptr<Connection> datagram_; // The record of the UDP socket in UDP mode, it owns the socket
+    DatagramSocket *datagramSocket_ = nullptr;
+
+    // All connections for the current thread, indexed by fd
+    FdSlab<ConnEntry> connections_;
+
+    // Wake up a lagging event loop when this many closed connections wait for it
+    const size_t maxRetired_ = 64;
+
+    std::deque<RetiredEntry> retired_;
+
+    std::mutex retireMutex_;
 
     OnCreate<T> OnCreate_;
 
     OnMessage<T> OnMessage_;
 
     OnClose<T> OnClose_;
+
+    CoHandler<T> OnConnection_;
+
+    OnHighWatermark<T> OnHighWatermark_;
+
+    OnDatagram OnDatagram_;
 };
 
 template<typename T>
@@ -101,13 +388,43 @@ ThreadManager<T>::~ThreadManager() {
 
 template<typename T>
 requires HasSetFdFunction<T>
-bool ThreadManager<T>::Start(const std::shared_ptr<NetEvent> &listen) {
-    if (!CreateReadThread(listen)) {
+bool ThreadManager<T>::Start(const ListenSockets &listens) {
+    // The write thread must exist before the read thread accepts connections
+    if (rwSeparation_ && !CreateWriteThread()) {
         return false;
     }
-    if (rwSeparation_) {
-        return CreateWriteThread();
+    return CreateReadThread(listens);
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+bool ThreadManager<T>::StartDatagram(std::unique_ptr<DatagramSocket> socket) {
+    eventType_ = 0;
+    edgeTrigger_ = false;
+    auto event = CreateEvent({}, BaseEvent::EVENT_MODE_READ | BaseEvent::EVENT_MODE_WRITE);
+
+    // The socket delivers the datagrams itself, the read callback gets nothing
+    event->SetOnMessage([](Connection *, std::string &&) {});
+    event->SetOnClose([this](Connection *, std::string &&) {
+        datagramSocket_->OnError();
+    });
+
+    socket->SetOnDatagram([this](std::string &&msg, const SocketAddr &peer) {
+        LoopStats::Measure([&] { OnDatagram_(std::move(msg), peer); });
+    });
+    if (busyPollSocket_ > 0) {
+        socket->SetBusyPoll(busyPollSocket_);
+    }
+    datagramSocket_ = socket.get();
+    datagram_ = Connection::Create(event, std::move(socket));
+    datagram_->fd_ = datagramSocket_->Fd();
+
+    readThread_ = std::make_unique<IOThread>(event);
+    readThread_->SetCpu(cpu_);
+    if (!readThread_->Run()) {
+        return false;
     }
+    readThread_->AddNewEvent(datagram_.get(), BaseEvent::EVENT_READ | BaseEvent::EVENT_ERROR | BaseEvent::EVENT_HUB);
     return true;
 }
 
@@ -120,60 +437,192 @@ void ThreadManager<T>::Stop() {
         if (rwSeparation_) {
             writeThread_->Stop();
         }
+        if (datagramSocket_) {
+            datagramSocket_->Close();
+        }
     }
 }
 
 template<typename T>
 requires HasSetFdFunction<T>
 void ThreadManager<T>::OnNetEventCreate(int fd, const std::shared_ptr<Connection> &conn) {
-    std::lock_guard lock(mutex_);
-    T t;
-    OnCreate_(fd, &t);
+    auto entry = std::make_unique<ConnEntry>();
+    if (OnCreate_) {
+        LoopStats::Measure([&] { OnCreate_(fd, &entry->t); });
+    }
     if constexpr (IsPointer_v<T>) {
-        t->SetFd(fd);
-        t->SetThreadIndex(index_);
+        entry->t->SetFd(fd);
+        entry->t->SetThreadIndex(index_);
     } else {
-        t.SetFd(fd);
-        t.SetThreadIndex(index_);
+        entry->t.SetFd(fd);
+        entry->t.SetThreadIndex(index_);
+    }
+    entry->conn = conn;
+    conn->context_ = entry.get();
+
+    // Published before the fd is polled, the events may find it right away
+    if (!connections_.Insert(fd, entry.get())) {
+        if (OnClose_) {
+            OnClose_(entry->t, "fd out of range");
+        }
+        conn->netEvent_->Close();
+        return;
+    }
+    auto added = entry.release();
+    conn->poll_->Stats().connections.fetch_add(1, std::memory_order_relaxed);
+
+    // The socket belongs to the connection, whoever changes its data holds a reference
+    auto socket = static_cast<StreamSocket *>(conn->netEvent_.get());
+    socket->SetPendingGauge(&conn->poll_->Stats().pendingSendBytes);
+    if (zeroCopyThreshold_ > 0 && conn->poll_->Type() != BaseEvent::EVENT_TYPE_URING) {
+        // Set before the fd is polled, the completions arrive as EPOLLERR
+        conn->zeroCopy_ = socket->EnableZeroCopy(zeroCopyThreshold_);
+    }
+    if (busyPollSocket_ > 0) {
+        socket->SetBusyPoll(busyPollSocket_);
+    }
+    if (highWatermark_ > 0) {
+        socket->SetWatermarks(highWatermark_, lowWatermark_, [this, c = conn.get()](bool high, size_t pending) {
+            OnWatermark(c, high, pending);
+        });
+    }
+
+    readThread_->AddNewEvent(conn.get(), BaseEvent::EVENT_READ | BaseEvent::EVENT_ERROR | BaseEvent::EVENT_HUB);
+    if (rwSeparation_ && (conn->poll_->Mode() & BaseEvent::EVENT_MODE_EDGE)) {
+        // Edge-triggered connections are registered for write readiness once
+        writeThread_->AddNewEvent(conn.get(), BaseEvent::EVENT_WRITE);
+    }
+
+    if (idleTimeout_ > 0) {
+        conn->lastActive_ = TimerWheel::Clock();
+        ArmIdleTimer(conn, idleTimeout_);
     }
 
-    readThread_->AddNewEvent(conn->fd_, BaseEvent::EVENT_READ | BaseEvent::EVENT_ERROR | BaseEvent::EVENT_HUB);
+    if (OnConnection_) {// last, the handler may close the connection right away
+        added->co = std::make_unique<CoConnection<T>>(this, conn.get(), added->t);
+        LoopStats::Measure([&] { added->co->Start(OnConnection_); });
+    } else if (workers_) {
+        added->strand = std::make_shared<Strand>();
+        added->strand->manager = this;
+        added->strand->conn = conn;
+    }
+}
 
-    connections_.emplace(fd, std::make_pair(t, conn));
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::OnNetEventMessage(Connection *conn, std::string &&readData) {
+    if (conn->closed_) {
+        return;
+    }
+    if (idleTimeout_ > 0) {
+        conn->lastActive_ = TimerWheel::Clock();
+    }
+    if (readData.empty() && OnConnection_) {// readiness without data, the end of the stream closes the connection
+        return;
+    }
+    if (codec_) {
+        DecodeFrames(conn, std::move(readData));
+        return;
+    }
+    Deliver(conn, std::move(readData));
 }
 
 template<typename T>
 requires HasSetFdFunction<T>
-void ThreadManager<T>::OnNetEventMessage(int fd, std::string &&readData) {
-    std::shared_lock lock(mutex_);
-    auto iter = connections_.find(fd);
-    if (iter == connections_.end()) {
+void ThreadManager<T>::Deliver(Connection *conn, std::string &&msg) {
+    // The entry lives as long as the Connection record, no lookup is needed
+    auto entry = static_cast<ConnEntry *>(conn->context_);
+    if (entry->co) {
+        LoopStats::Measure([&] { entry->co->OnMessage(std::move(msg)); });
         return;
     }
-    OnMessage_(std::move(readData), iter->second.first);
+    if (auto &strand = entry->strand) {
+        bool idle = strand->pending.fetch_add(1, std::memory_order_acq_rel) == 0;
+        strand->messages.Push(std::move(msg));
+        if (idle) {// the worker that ran it last has let it go
+            strand->self = strand;
+            workers_->Submit(strand.get());
+        }
+        return;
+    }
+    LoopStats::Measure([&] { OnMessage_(std::move(msg), entry->t); });
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::RunStrand(Strand *strand) {
+    // Let go before the count drops, the read thread takes it again once it reaches 0
+    auto self = std::move(strand->self);
+    size_t handled = 0;
+    {
+        // Pinned before closed_ is checked: the entry of an open connection stays until the guard ends
+        Epoch::Guard guard;
+        auto &conn = strand->conn;
+        strand->messages.Consume([&](std::string &&msg) {
+            ++handled;
+            if (!conn->closed_) {// the rest of a closed connection is dropped
+                OnMessage_(std::move(msg), static_cast<ConnEntry *>(conn->context_)->t);
+            }
+        });
+    }
+    if (strand->pending.fetch_sub(handled, std::memory_order_acq_rel) != handled) {
+        // More came in meanwhile, queue it again so that the other connections get their turn
+        strand->self = std::move(self);
+        workers_->Submit(strand);
+    }
 }
 
 template<typename T>
 requires HasSetFdFunction<T>
-void ThreadManager<T>::OnNetEventClose(int fd, std::string &&err) {
-    std::lock_guard lock(mutex_);
-    auto iter = connections_.find(fd);
-    if (iter == connections_.end()) {
+void ThreadManager<T>::OnNetEventClose(Connection *conn, std::string &&err) {
+    if (conn->closed_) {
         return;
     }
-    OnClose_(iter->second.first, std::move(err));
-    iter->second.second->netEvent_->Close();//close socket
-    connections_.erase(iter);
+    if (!readThread_->InThread()) {
+        // The write thread and the application hand the close to the read thread, so that
+        // OnClose never runs alongside OnMessage and the coroutine of the connection
+        auto &shared = static_cast<ConnEntry *>(conn->context_)->conn;
+        readThread_->RunInLoop([this, weakConn = std::weak_ptr(shared), err = std::move(err)]() mutable {
+            if (auto conn = weakConn.lock()) {
+                OnNetEventClose(conn.get(), std::move(err));
+            }
+        });
+        return;
+    }
+    std::unique_ptr<ConnEntry> entry(static_cast<ConnEntry *>(conn->context_));
+    // Closed already, the fd may belong to a new connection by now
+    if (!connections_.Remove(conn->fd_, entry.get())) {
+        entry.release();
+        return;
+    }
+    conn->closed_ = true;
+    if (auto timer = conn->idleTimer_.exchange(0)) {
+        readThread_->CancelTimer(timer);
+    }
+    conn->poll_->Stats().connections.fetch_sub(1, std::memory_order_relaxed);
+    if (OnClose_) {
+        LoopStats::Measure([&] { OnClose_(entry->t, std::move(err)); });
+    }
+    if (conn->poll_->Type() == BaseEvent::EVENT_TYPE_URING) {// io_uring keeps a state per fd until it is removed
+        conn->poll_->DelEvent(conn->fd_);
+        if (rwSeparation_) {// the write ring removes it when it takes this, before any send of a new connection
+            writeThread_->PostSend(entry->conn, std::string());
+        }
+    }
+    conn->netEvent_->Close();//close socket, this also removes it from the multiplexes
+    if (entry->co) {
+        LoopStats::Measure([&] { entry->co->OnClose(); });
+    }
+    Retire(std::move(entry));
 }
 
 template<typename T>
 requires HasSetFdFunction<T>
 void ThreadManager<T>::CloseConnection(int fd) {
-    readThread_->CloseConnection(fd);
-    if (rwSeparation_) {
-        writeThread_->CloseConnection(fd);
+    Epoch::Guard guard;
+    if (auto entry = connections_.Get(fd)) {
+        OnNetEventClose(entry->conn.get(), "");
     }
-    OnNetEventClose(fd, "");
 }
 
 template<typename T>
@@ -188,90 +637,474 @@ void ThreadManager<T>::Wait() {
 template<typename T>
 requires HasSetFdFunction<T>
 void ThreadManager<T>::SendPacket(const T &conn, std::string &&msg) {
-    std::shared_lock lock(mutex_);
     int fd = 0;
     if constexpr (IsPointer_v<T>) {
         fd = conn->GetFd();
     } else {
         fd = conn.GetFd();
     }
-    auto iter = connections_.find(fd);
-    if (iter == connections_.end()) {
+    Epoch::Guard guard;
+    auto entry = connections_.Get(fd);
+    if (!entry) {
         return;
     }
 
-    iter->second.second->netEvent_->SendPacket(std::move(msg));
+    auto &connection = entry->conn;
+    auto &sendThread = rwSeparation_ ? writeThread_ : readThread_;
+    if (!readThread_->InThread() || connection->poll_->Type() == BaseEvent::EVENT_TYPE_URING) {
+        // The thread that sends for the connection queues and flushes the message itself,
+        // the caller neither takes the socket lock nor changes the poll interest.
+        // io_uring owns the queue while its send is in flight and always goes this way
+        sendThread->PostSend(connection, std::move(msg));
+        return;
+    }
 
-    if (rwSeparation_) {
-        writeThread_->SetWriteEvent(iter->first);
+    // Called from OnMessage: write right away and only arm the write interest for the remainder.
+    // On error the read side sees the broken connection and closes it
+    auto socket = static_cast<StreamSocket *>(connection->netEvent_.get());
+    auto ret = socket->WriteThrough(std::move(msg));
+    if (ret > 0) {
+        ArmWrite(connection);
+    } else if (ret == 0 && connection->peerClosed_) {
+        CloseAfterSend(connection);
+    }
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::Connect(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback) {
+    readThread_->RunInLoop([this, addr, timeout, callback = std::move(callback)]() mutable {
+        StartConnect(addr, timeout, std::move(callback));
+    });
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::Acquire(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback) {
+    readThread_->RunInLoop([this, addr, timeout, callback = std::move(callback)]() mutable {
+        auto iter = pool_.find(addr);
+        while (iter != pool_.end() && !iter->second.empty()) {
+            auto conn = iter->second.back().lock();
+            iter->second.pop_back();
+            if (conn && !conn->closed_) {
+                LoopStats::Measure([&] { callback(&static_cast<ConnEntry *>(conn->context_)->t, ""); });
+                return;
+            }
+        }
+        StartConnect(addr, timeout, std::move(callback));
+    });
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::Release(int fd) {
+    readThread_->RunInLoop([this, fd] {
+        Epoch::Guard guard;
+        auto entry = connections_.Get(fd);
+        if (!entry || entry->upstream.Empty()) {// closed, or not made by Connect
+            return;
+        }
+        auto &idle = pool_[entry->upstream];
+        std::erase_if(idle, [](const std::weak_ptr<Connection> &weakConn) {
+            auto conn = weakConn.lock();
+            return !conn || conn->closed_;
+        });
+        for (const auto &weakConn: idle) {// released twice
+            if (weakConn.lock() == entry->conn) {
+                return;
+            }
+        }
+        if (idle.size() >= poolSize_) {
+            OnNetEventClose(entry->conn.get(), "pool full");
+            return;
+        }
+        idle.push_back(entry->conn);
+    });
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::StartConnect(const SocketAddr &addr, int64_t timeout, OnConnect<T> &&callback) {
+    auto socket = StreamSocket::Connect(addr);
+    if (!socket) {
+        std::string err = strerror(errno);
+        LoopStats::Measure([&] { callback(nullptr, std::move(err)); });
+        return;
+    }
+    int fd = socket->Fd();
+    auto &event = readThread_->Event();
+    auto conn = Connection::Create(event, std::move(socket));
+    conn->fd_ = fd;
+
+    auto &pending = connecting_[fd];
+    pending = {conn, addr, std::move(callback), 0};
+    if (timeout > 0) {
+        pending.timer = readThread_->RunTimer(timeout, 0, [this, fd, c = conn.get()] {
+            OnConnectTimeout(fd, c);
+        });
+    }
+    event->AddConnectEvent(conn.get());
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::OnNetEventConnect(Connection *conn) {
+    auto iter = connecting_.find(conn->fd_);
+    if (iter == connecting_.end() || iter->second.conn.get() != conn) {
+        return;
+    }
+    auto pending = std::move(iter->second);
+    connecting_.erase(iter);
+    if (pending.timer) {
+        readThread_->CancelTimer(pending.timer);
+    }
+
+    auto socket = static_cast<StreamSocket *>(conn->netEvent_.get());
+    if (int err = socket->ConnectResult()) {
+        socket->Close();
+        LoopStats::Measure([&] { pending.callback(nullptr, strerror(err)); });
+        return;
+    }
+    if (conn->poll_->Mode() & BaseEvent::EVENT_MODE_EDGE) {
+        socket->SetEdgeTrigger();
+    }
+    // From here on it is served like an accepted connection
+    OnNetEventCreate(conn->fd_, pending.conn);
+    if (socket->Fd() < 0) {
+        LoopStats::Measure([&] { pending.callback(nullptr, "fd out of range"); });
+        return;
+    }
+    auto entry = static_cast<ConnEntry *>(conn->context_);
+    entry->upstream = pending.addr;
+    LoopStats::Measure([&] { pending.callback(&entry->t, ""); });
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::OnConnectTimeout(int fd, Connection *conn) {
+    auto iter = connecting_.find(fd);
+    if (iter == connecting_.end() || iter->second.conn.get() != conn) {
+        return;
+    }
+    auto pending = std::move(iter->second);
+    connecting_.erase(iter);
+    conn->connecting_ = false;
+    conn->poll_->DelEvent(conn->fd_);
+    conn->netEvent_->Close();
+    LoopStats::Measure([&] { pending.callback(nullptr, "connect timeout"); });
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::SendTo(const SocketAddr &peer, std::string &&msg) {
+    if (datagramSocket_->SendTo(peer, std::move(msg))) {// the first one of the round schedules the flush
+        readThread_->QueueInLoop([this] {
+            FlushDatagrams();
+        });
+    }
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::FlushDatagrams() {
+    // Write readiness calls OnWritable again, which drops the interest once the queue is empty
+    if (datagramSocket_->OnWritable() > 0) {
+        readThread_->SetWriteEvent(datagram_.get());
+    }
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+bool ThreadManager<T>::SendFile(const T &conn, int fd, off_t offset, size_t length) {
+    int connFd = 0;
+    if constexpr (IsPointer_v<T>) {
+        connFd = conn->GetFd();
     } else {
-        readThread_->SetWriteEvent(iter->first);
+        connFd = conn.GetFd();
     }
+    Epoch::Guard guard;
+    auto entry = connections_.Get(connFd);
+    if (!entry) {
+        return false;
+    }
+    int file = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (file < 0) {
+        return false;
+    }
+
+    auto &connection = entry->conn;
+    auto &sendThread = rwSeparation_ ? writeThread_ : readThread_;
+    if (!readThread_->InThread() || connection->poll_->Type() == BaseEvent::EVENT_TYPE_URING) {
+        sendThread->PostSendFile(connection, FileSegment(file, offset, length));
+        return true;
+    }
+    auto socket = static_cast<StreamSocket *>(connection->netEvent_.get());
+    auto ret = socket->WriteThrough(FileSegment(file, offset, length));
+    if (ret > 0) {
+        ArmWrite(connection);
+    } else if (ret == 0 && connection->peerClosed_) {
+        CloseAfterSend(connection);
+    }
+    return true;
 }
 
 template<typename T>
 requires HasSetFdFunction<T>
-bool ThreadManager<T>::CreateReadThread(const std::shared_ptr<NetEvent> &listen) {
-    std::shared_ptr<BaseEvent> event;
+void ThreadManager<T>::CollectStats(ServerStats *stats) {
+    stats->loops.push_back({index_, false, readThread_->Stats().Snapshot()});
+    if (rwSeparation_) {
+        stats->loops.push_back({index_, true, writeThread_->Stats().Snapshot()});
+    }
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+bool ThreadManager<T>::CreateReadThread(const ListenSockets &listens) {
     int8_t eventMode = BaseEvent::EVENT_MODE_READ;
     if (!rwSeparation_) {
         eventMode |= BaseEvent::EVENT_MODE_WRITE;
     }
 
-#if defined(HAVE_EPOLL)
-    event = std::make_shared<EpollEvent>(listen, eventMode);
-#elif defined(HAVE_KQUEUE)
-    event = std::make_shared<KqueueEvent>(listen, eventMode);
-#endif
+    auto event = CreateEvent(listens, eventMode);
 
     event->SetOnCreate([this](int fd, const std::shared_ptr<Connection> &conn) {
         OnNetEventCreate(fd, conn);
     });
 
-    event->SetOnMessage([this](int fd, std::string &&readData) {
-        OnNetEventMessage(fd, std::move(readData));
+    event->SetOnMessage([this](Connection *conn, std::string &&readData) {
+        OnNetEventMessage(conn, std::move(readData));
     });
 
-    event->SetOnClose([this](int fd, std::string &&err) {
-        OnNetEventClose(fd, std::move(err));
+    event->SetOnClose([this](Connection *conn, std::string &&err) {
+        OnNetEventClose(conn, std::move(err));
     });
 
-    event->SetGetConn([this](int fd) -> std::shared_ptr<Connection> {
-        std::shared_lock lock(mutex_);
-        auto iter = connections_.find(fd);
-        if (iter == connections_.end()) {
-            return nullptr;
-        }
-        return iter->second.second;
+    event->SetOnConnect([this](Connection *conn) {
+        OnNetEventConnect(conn);
+    });
+
+    event->SetOnEndOfStream([this](Connection *conn) {
+        // Behind the answers posted for it, the loop that sends closes the connection once they are out
+        auto &sendThread = rwSeparation_ ? writeThread_ : readThread_;
+        sendThread->PostSend(static_cast<ConnEntry *>(conn->context_)->conn, std::string());
+    });
+
+    event->SetGetConn([this](int fd) {
+        return GetConn(fd);
     });
 
     readThread_ = std::make_unique<IOThread>(event);
+    readThread_->SetCpu(cpu_);
     return readThread_->Run();
 }
 
 template<typename T>
 requires HasSetFdFunction<T>
 bool ThreadManager<T>::CreateWriteThread() {
+    auto event = CreateEvent({}, BaseEvent::EVENT_MODE_WRITE);
+
+    event->SetOnClose([this](Connection *conn, std::string &&msg) {
+        OnNetEventClose(conn, std::move(msg));
+    });
+    event->SetGetConn([this](int fd) {
+        return GetConn(fd);
+    });
+
+    writeThread_ = std::make_unique<IOThread>(event);
+    writeThread_->SetCpu(cpu_);
+    return writeThread_->Run();
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+std::shared_ptr<BaseEvent> ThreadManager<T>::CreateEvent(const ListenSockets &listens, int8_t mode) {
     std::shared_ptr<BaseEvent> event;
+#if defined(HAVE_IO_URING)
+    if (eventType_ == BaseEvent::EVENT_TYPE_URING && UringEvent::Supported()) {
+        event = std::make_shared<UringEvent>(listens, mode);
+    }
+#endif
 
+    if (!event) {
 #if defined(HAVE_EPOLL)
-    event = std::make_shared<EpollEvent>(nullptr, BaseEvent::EVENT_MODE_WRITE);
+        if (edgeTrigger_) {
+            mode |= BaseEvent::EVENT_MODE_EDGE;
+        }
+        event = std::make_shared<EpollEvent>(listens, mode);
 #elif defined(HAVE_KQUEUE)
-    event = std::make_shared<KqueueEvent>(nullptr, BaseEvent::EVENT_MODE_WRITE);
+        event = std::make_shared<KqueueEvent>(listens, mode);
 #endif
+    }
+    event->SetBusyPoll(busyPollSpin_);
+    return event;
+}
 
-    event->SetOnClose([this](int fd, std::string &&msg) {
-        OnNetEventClose(fd, std::move(msg));
+template<typename T>
+requires HasSetFdFunction<T>
+std::shared_ptr<Connection> ThreadManager<T>::GetConn(int fd) {
+    Epoch::Guard guard;
+    auto entry = connections_.Get(fd);
+    if (!entry) {
+        return nullptr;
+    }
+    return entry->conn;
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::DecodeFrames(Connection *conn, std::string &&data) {
+    size_t pos = conn->readPos_;
+    while (!conn->closed_) {
+        size_t payloadPos = 0;
+        size_t payloadSize = 0;
+        auto size = codec_->Decode(std::string_view(data).substr(pos), &conn->readScanned_, &payloadPos,
+                                   &payloadSize);
+        if (size == NE_ERROR) {
+            OnNetEventClose(conn, "decode error");
+            return;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (pos + size == data.size() && payloadSize >= data.capacity() / 2) {
+            // The last frame fills most of the buffer, it takes the buffer instead of a copy.
+            // A small one leaves a kept buffer to the next read
+            data.resize(pos + payloadPos + payloadSize);
+            data.erase(0, pos + payloadPos);
+            conn->readPos_ = 0;
+            conn->readScanned_ = 0;
+            Deliver(conn, std::move(data));
+            return;
+        }
+        Deliver(conn, data.substr(pos + payloadPos, payloadSize));
+        pos += size;
+        conn->readScanned_ = 0;
+    }
+
+    if (conn->closed_ || pos == data.size()) {
+        conn->readPos_ = 0;
+        // The emptied buffer takes the next read, unless a burst made it larger than the reads need now
+        auto socket = static_cast<StreamSocket *>(conn->netEvent_.get());
+        if (!conn->closed_ && data.capacity() <= 2 * socket->ReadHint()) {
+            data.clear();
+            conn->readBuff_ = std::move(data);
+        }
+        return;
+    }
+    // The partial frame stays where it is, the consumed part is dropped
+    // once it outweighs it so that each byte is moved at most once on average
+    if (pos > data.size() / 2) {
+        data.erase(0, pos);
+        pos = 0;
+    }
+    conn->readBuff_ = std::move(data);
+    conn->readPos_ = pos;
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::CloseAfterSend(const std::shared_ptr<Connection> &conn) {
+    readThread_->QueueInLoop([this, conn] {
+        if (BaseEvent::Drained(conn.get())) {
+            OnNetEventClose(conn.get(), "");
+        }
     });
-    event->SetGetConn([this](int fd) -> std::shared_ptr<Connection> {
-        std::shared_lock lock(mutex_);
-        auto iter = connections_.find(fd);
-        if (iter == connections_.end()) {
-            return nullptr;
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::ArmWrite(const std::shared_ptr<Connection> &conn) {
+    auto &sendThread = rwSeparation_ ? writeThread_ : readThread_;
+    if (sendThread->InThread()) {
+        sendThread->SetWriteEvent(conn.get());
+    } else {
+        sendThread->PostSend(conn, std::string());
+    }
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::ArmIdleTimer(const std::shared_ptr<Connection> &conn, int64_t delay) {
+    conn->idleTimer_ = readThread_->RunTimer(delay, 0, [this, weakConn = std::weak_ptr(conn)] {
+        OnIdleTimer(weakConn);
+    });
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::OnIdleTimer(const std::weak_ptr<Connection> &weakConn) {
+    auto conn = weakConn.lock();
+    if (!conn || conn->closed_) {
+        return;
+    }
+    conn->idleTimer_ = 0;// fired
+    // Reads only refresh the timestamp, the timer is moved here when it fires
+    auto idle = TimerWheel::Clock() - conn->lastActive_;
+    if (idle >= idleTimeout_) {
+        OnNetEventClose(conn.get(), "idle timeout");
+        return;
+    }
+    ArmIdleTimer(conn, idleTimeout_ - idle);
+}
+
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::OnWatermark(Connection *conn, bool high, size_t pending) {
+    if (conn->closed_) {
+        return;
+    }
+    auto entry = static_cast<ConnEntry *>(conn->context_);
+    if (high && OnHighWatermark_) {
+        LoopStats::Measure([&] { OnHighWatermark_(entry->t, pending); });
+    }
+    if (!pauseReading_ && !entry->co) {
+        return;
+    }
+    conn->poll_->RunInLoop([this, weakConn = std::weak_ptr(entry->conn)] {
+        auto conn = weakConn.lock();
+        if (!conn || conn->closed_) {
+            return;
+        }
+        auto socket = static_cast<StreamSocket *>(conn->netEvent_.get());
+        bool above = socket->AboveHighWatermark();
+        if (pauseReading_) {
+            conn->poll_->SetReadEnabled(conn.get(), !above && !conn->peerClosed_);
+        }
+        auto entry = static_cast<ConnEntry *>(conn->context_);
+        if (!above && entry->co) {// a write of the coroutine waits for the drain
+            LoopStats::Measure([&] { entry->co->OnDrained(); });
         }
-        return iter->second.second;
     });
+}
 
-    writeThread_ = std::make_unique<IOThread>(event);
-    return writeThread_->Run();
+template<typename T>
+requires HasSetFdFunction<T>
+void ThreadManager<T>::Retire(std::unique_ptr<ConnEntry> &&entry) {
+    std::vector<std::unique_ptr<ConnEntry>> released;
+    {
+        std::lock_guard lock(retireMutex_);
+        retired_.push_back({std::move(entry), readThread_->Generation(),
+                            rwSeparation_ ? writeThread_->Generation() : 0, Epoch::Advance()});
+
+        // A loop that finished the round it was in when the connection was closed
+        // cannot see it anymore, the socket close removed it from the poll
+        auto readGeneration = readThread_->Generation();
+        auto writeGeneration = rwSeparation_ ? writeThread_->Generation() : 1;
+        // A thread that pinned an epoch at or after the removal loaded the emptied slot
+        auto oldestEpoch = Epoch::Oldest();
+        while (!retired_.empty() && retired_.front().readGeneration < readGeneration &&
+               retired_.front().writeGeneration < writeGeneration && retired_.front().epoch <= oldestEpoch) {
+            released.push_back(std::move(retired_.front().entry));
+            retired_.pop_front();
+        }
+
+        if (retired_.size() >= maxRetired_) {// An idle loop never ends its round by itself
+            if (retired_.front().readGeneration >= readGeneration) {
+                readThread_->Wakeup();
+            }
+            if (rwSeparation_ && retired_.front().writeGeneration >= writeGeneration) {
+                writeThread_->Wakeup();
+            }
+        }
+    }
 }
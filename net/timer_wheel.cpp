@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <chrono>
+
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel() {
+    tick_ = Clock();
+}
+
+TimerWheel::~TimerWheel() {
+    for (auto &[id, timer]: timers_) {
+        if (timer != running_) {
+            delete timer;
+        }
+    }
+}
+
+int64_t TimerWheel::Clock() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TimerWheel::Add(uint64_t id, int64_t delay, int64_t interval, Callback &&callback) {
+    auto timer = new Timer{id, Clock() + std::max<int64_t>(delay, 0), interval, std::move(callback)};
+    timers_[id] = timer;
+    Link(timer);
+}
+
+void TimerWheel::Cancel(uint64_t id) {
+    auto iter = timers_.find(id);
+    if (iter == timers_.end()) {
+        return;
+    }
+    auto timer = iter->second;
+    timers_.erase(iter);
+    if (timer == running_) {// deleted once its callback returns
+        runningCancelled_ = true;
+        return;
+    }
+    Unlink(timer);
+    delete timer;
+}
+
+void TimerWheel::Advance(int64_t now) {
+    if (count_ == 0) {
+        tick_ = now + 1;
+        return;
+    }
+    while (tick_ <= now) {
+        RunTick();
+        ++tick_;
+    }
+}
+
+int TimerWheel::Timeout() const {
+    if (count_ == 0) {
+        return -1;
+    }
+    if (expired_) {
+        return 0;
+    }
+    // The next occupied slot of the root wheel, or the next cascade of the wheel above it
+    int64_t next = (tick_ | (rootSize_ - 1)) + 1;
+    for (int64_t tick = tick_; tick < next; ++tick) {
+        if (root_[tick & (rootSize_ - 1)]) {
+            next = tick;
+            break;
+        }
+    }
+    return static_cast<int>(std::max<int64_t>(next - Clock(), 0));
+}
+
+void TimerWheel::Link(Timer *timer) {
+    // Due already, runs on the next tick. While the callbacks of tick_ run its slot is gone, that is tick_ + 1
+    auto next = running_ ? tick_ + 1 : tick_;
+    if (timer->expires < next) {
+        timer->expires = next;
+    }
+    auto delay = std::min(timer->expires - tick_, maxDelay_);
+    auto expires = tick_ + delay;
+
+    Timer **bucket;
+    if (delay < rootSize_) {
+        bucket = &root_[expires & (rootSize_ - 1)];
+    } else {
+        int level = 1;
+        while (delay >= (int64_t(1) << Shift(level + 1))) {
+            ++level;
+        }
+        bucket = &wheels_[level - 1][(expires >> Shift(level)) & (levelSize_ - 1)];
+    }
+
+    timer->bucket = bucket;
+    timer->prev = nullptr;
+    timer->next = *bucket;
+    if (*bucket) {
+        (*bucket)->prev = timer;
+    }
+    *bucket = timer;
+    ++count_;
+}
+
+void TimerWheel::Unlink(Timer *timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->bucket = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = nullptr;
+    timer->bucket = nullptr;
+    --count_;
+}
+
+int TimerWheel::Cascade(int level) {
+    int index = static_cast<int>((tick_ >> Shift(level)) & (levelSize_ - 1));
+    auto &bucket = wheels_[level - 1][index];
+    auto timer = bucket;
+    bucket = nullptr;
+    while (timer) {
+        auto next = timer->next;
+        --count_;// Link counts it again
+        Link(timer);
+        timer = next;
+    }
+    return index;
+}
+
+void TimerWheel::RunTick() {
+    if ((tick_ & (rootSize_ - 1)) == 0) {
+        for (int level = 1; level < levels_ && Cascade(level) == 0; ++level) {
+        }
+    }
+
+    // Move the due timers aside, the callbacks may cancel and arm timers
+    auto &bucket = root_[tick_ & (rootSize_ - 1)];
+    expired_ = bucket;
+    bucket = nullptr;
+    for (auto timer = expired_; timer; timer = timer->next) {
+        timer->bucket = &expired_;
+    }
+
+    while (expired_) {
+        auto timer = expired_;
+        Unlink(timer);
+        if (timer->expires > tick_) {// clamped to the longest delay of the wheel
+            Link(timer);
+            continue;
+        }
+
+        running_ = timer;
+        runningCancelled_ = false;
+        timer->callback();
+        running_ = nullptr;
+
+        if (!runningCancelled_ && timer->interval > 0) {
+            timer->expires = tick_ + timer->interval;
+            Link(timer);
+            continue;
+        }
+        if (!runningCancelled_) {
+            timers_.erase(timer->id);
+        }
+        delete timer;
+    }
+}
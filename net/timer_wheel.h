@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+// Hierarchical timing wheel with a resolution of one millisecond.
+// Level 0 has a slot per millisecond for the next 256ms, every higher level
+// has 64 slots that each cover a whole turn of the level below. Timers are
+// cascaded down one level when the lower wheel wraps around, so arming and
+// cancelling are O(1) and a tick only touches the timers due in it.
+// Not thread-safe, a wheel belongs to one event loop
+class TimerWheel {
+public:
+    using Callback = std::function<void()>;
+
+    TimerWheel();
+
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel &) = delete;
+
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // Arm timer id to fire after delay ms, and then every interval ms when interval > 0
+    void Add(uint64_t id, int64_t delay, int64_t interval, Callback &&callback);
+
+    // Cancel the timer, unknown or finished ids are ignored
+    void Cancel(uint64_t id);
+
+    // Run every timer that is due at now
+    void Advance(int64_t now);
+
+    // Milliseconds until the wheel needs to advance, -1 when no timer is armed
+    int Timeout() const;
+
+    // Milliseconds of the monotonic clock
+    static int64_t Clock();
+
+private:
+    struct Timer {
+        uint64_t id;
+        int64_t expires;
+        int64_t interval;
+        Callback callback;
+        Timer *prev = nullptr;
+        Timer *next = nullptr;
+        Timer **bucket = nullptr;// the list the timer is linked into
+    };
+
+    static constexpr int levels_ = 5;
+    static constexpr int rootBits_ = 8;
+    static constexpr int levelBits_ = 6;
+    static constexpr int rootSize_ = 1 << rootBits_;
+    static constexpr int levelSize_ = 1 << levelBits_;
+    static constexpr int64_t maxDelay_ = (int64_t(1) << (rootBits_ + levelBits_ * (levels_ - 1))) - 1;
+
+    static int Shift(int level) {
+        return level == 0 ? 0 : rootBits_ + levelBits_ * (level - 1);
+    }
+
+    // Put the timer in the slot of its expiry relative to the current tick
+    void Link(Timer *timer);
+
+    void Unlink(Timer *timer);
+
+    // Move the timers of the current slot of level down to the lower levels,
+    // return the slot index
+    int Cascade(int level);
+
+    // Run the timers due at tick_
+    void RunTick();
+
+private:
+    int64_t tick_ = 0;// next tick to run
+
+    Timer *root_[rootSize_] = {};
+    Timer *wheels_[levels_ - 1][levelSize_] = {};
+    Timer *expired_ = nullptr;// due timers of the tick that is running
+
+    size_t count_ = 0;
+    std::unordered_map<uint64_t, Timer *> timers_;
+
+    Timer *running_ = nullptr;
+    bool runningCancelled_ = false;
+};
@@ -0,0 +1,684 @@
+
+#include "uring_event.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include "listen_socket.h"
+#include "stream_socket.h"
+
+namespace {
+
+int UringSetup(unsigned entries, io_uring_params *params) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int UringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void *arg = nullptr,
+               size_t argSize = 0) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize));
+}
+
+int UringRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs));
+}
+
+}
+
+UringEvent::~UringEvent() {
+    Close();
+    if (bufRing_) {
+        ::munmap(bufRing_, bufRingSize_);
+    }
+    if (sqes_) {
+        ::munmap(sqes_, sqesSize_);
+    }
+    if (cqRing_ && cqRing_ != sqRing_) {
+        ::munmap(cqRing_, cqRingSize_);
+    }
+    if (sqRing_) {
+        ::munmap(sqRing_, sqRingSize_);
+    }
+}
+
+bool UringEvent::Supported() {
+    static const bool supported = [] {
+        io_uring_params params{};
+        int fd = UringSetup(8, &params);
+        if (fd < 0) {// io_uring is missing or disabled
+            return false;
+        }
+
+        // The wait of the loop is bounded by the timers through IORING_ENTER_EXT_ARG (5.11)
+        bool ok = (params.features & IORING_FEAT_NODROP) && (params.features & IORING_FEAT_EXT_ARG);
+
+        // All the opcodes used by the multiplex must be known by the kernel
+        constexpr int probeOps = 256;
+        std::vector<char> probeBuff(sizeof(io_uring_probe) + probeOps * sizeof(io_uring_probe_op));
+        auto probe = reinterpret_cast<io_uring_probe *>(probeBuff.data());
+        if (ok && UringRegister(fd, IORING_REGISTER_PROBE, probe, probeOps) == 0) {
+            for (auto op: {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ,
+                            IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD}) {
+                if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                    ok = false;
+                }
+            }
+        } else {
+            ok = false;
+        }
+
+        // Provided buffer rings (5.19) are required by the multishot recv
+        void *ring = MAP_FAILED;
+        if (ok) {
+            ring = ::mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            io_uring_buf_reg reg{};
+            reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+            reg.ring_entries = 8;
+            ok = ring != MAP_FAILED && UringRegister(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+        }
+
+        ::close(fd);
+        if (ring != MAP_FAILED) {
+            ::munmap(ring, 4096);
+        }
+        return ok;
+    }();
+    return supported;
+}
+
+bool UringEvent::Init() {
+    if (!SetupRing()) {
+        return false;
+    }
+    if ((mode_ & EVENT_MODE_READ) && !SetupBufferRing()) {
+        return false;
+    }
+
+    if (!OpenWakeup()) {
+        return false;
+    }
+    PrepWakeup();
+
+    for (size_t i = 0; i < listens_.size(); ++i) {// Accept on the listen sockets, unless another thread accepts
+        if (mode_ & EVENT_MODE_READ) {
+            PrepAccept(i);
+        }
+    }
+    return true;
+}
+
+void UringEvent::AddEvent(Connection *conn, int) {
+    if (!(mode_ & EVENT_MODE_READ)) {// a write only ring never receives
+        return;
+    }
+    // On the loop the state starts before the connection is handed out,
+    // completions of an old connection on the fd no longer match it
+    if (InLoopThread()) {
+        ArmRecv(conn->fd_, ResetState(conn->fd_));
+    } else {
+        Push(conn->fd_, OP_RECV);
+    }
+}
+
+void UringEvent::DelEvent(int fd) {
+    // A socket closed from another thread is shut down first,
+    // which ends its recv with a completion that the loop cleans up
+    if (!InLoopThread()) {
+        return;
+    }
+    auto iter = fds_.find(fd);
+    if (iter == fds_.end()) {
+        return;
+    }
+    if (iter->second.sending) {// the kernel still reads the buffer
+        orphanSends_.emplace(iter->second.gen, std::move(iter->second.send));
+    }
+    if (iter->second.connecting) {// given up, the poll would hold the socket until the connect fails
+        PrepCancel(UserData(OP_CONNECT, fd, iter->second.gen));
+    }
+    fds_.erase(iter);
+}
+
+void UringEvent::EventPoll() {
+    StartLoop();
+    while (running_) {
+        DrainAccepted();// before the pending operations, they include the first recv of these connections
+        DrainPending();
+        DrainMailbox();
+        // Submit everything queued by the last round and wait for completions or the next timer
+        if (Enter(1, PollTimeout()) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME) {
+            break;
+        }
+        Reap();
+        EndRound();
+    }
+}
+
+void UringEvent::AddWriteEvent(Connection *conn) {
+    Push(conn->fd_, OP_SEND);
+}
+
+void UringEvent::DelWriteEvent(Connection *) {
+}
+
+void UringEvent::SetReadEnabled(Connection *conn, bool enabled) {
+    if (conn->readPaused_ == !enabled) {
+        return;
+    }
+    conn->readPaused_ = !enabled;
+    auto iter = fds_.find(conn->fd_);
+    if (iter == fds_.end()) {
+        return;
+    }
+    auto &state = iter->second;
+    state.paused = !enabled;
+    if (enabled) {
+        ArmRecv(conn->fd_, state);
+    } else if (state.recving) {// the recv ends with -ECANCELED, data completed before it is still delivered
+        PrepCancel(UserData(OP_RECV, conn->fd_, state.gen));
+    }
+}
+
+void UringEvent::AddConnectEvent(Connection *conn) {
+    auto &state = ResetState(conn->fd_);
+    state.connecting = conn;
+    conn->connecting_ = true;
+    PrepConnect(conn->fd_, state.gen);
+}
+
+bool UringEvent::SetupRing() {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = ringEntries_ * 4;
+    fd_ = UringSetup(ringEntries_, &params);
+    if (fd_ < 0) {
+        return false;
+    }
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+
+    auto sq = ::mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return false;
+    }
+    sqRing_ = sq;
+
+    if (singleMmap) {
+        cqRing_ = sqRing_;
+    } else {
+        auto cq = ::mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                         IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return false;
+        }
+        cqRing_ = cq;
+    }
+
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    auto sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    auto sqPtr = static_cast<char *>(sqRing_);
+    sqHead_ = reinterpret_cast<unsigned *>(sqPtr + params.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned *>(sqPtr + params.sq_off.tail);
+    sqMask_ = *reinterpret_cast<unsigned *>(sqPtr + params.sq_off.ring_mask);
+    sqEntries_ = params.sq_entries;
+    sqeTail_ = *sqTail_;
+    // SQEs are always filled in ring order, so the index array is the identity
+    auto sqArray = reinterpret_cast<unsigned *>(sqPtr + params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries_; ++i) {
+        sqArray[i] = i;
+    }
+
+    auto cqPtr = static_cast<char *>(cqRing_);
+    cqHead_ = reinterpret_cast<unsigned *>(cqPtr + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned *>(cqPtr + params.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned *>(cqPtr + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cqPtr + params.cq_off.cqes);
+
+    return true;
+}
+
+bool UringEvent::SetupBufferRing() {
+    bufRingSize_ = bufferEntries_ * sizeof(io_uring_buf);
+    auto ring = ::mmap(nullptr, bufRingSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    bufRing_ = static_cast<io_uring_buf_ring *>(ring);
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufRing_);
+    reg.ring_entries = bufferEntries_;
+    reg.bgid = bufferGroup_;
+    if (UringRegister(Fd(), IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return false;
+    }
+
+    buffers_.reset(new char[bufferEntries_ * bufferSize_]);
+    for (unsigned bid = 0; bid < bufferEntries_; ++bid) {
+        RecycleBuffer(static_cast<uint16_t>(bid));
+    }
+    return true;
+}
+
+io_uring_sqe *UringEvent::GetSqe() {
+    if (sqeTail_ - std::atomic_ref(*sqHead_).load(std::memory_order_acquire) >= sqEntries_) {
+        Enter(0);
+        if (sqeTail_ - std::atomic_ref(*sqHead_).load(std::memory_order_acquire) >= sqEntries_) {
+            return nullptr;
+        }
+    }
+    auto sqe = &sqes_[sqeTail_ & sqMask_];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqeTail_;
+    return sqe;
+}
+
+int UringEvent::Enter(unsigned waitNr, int timeout) {
+    std::atomic_ref(*sqTail_).store(sqeTail_, std::memory_order_release);
+    unsigned toSubmit = sqeTail_ - std::atomic_ref(*sqHead_).load(std::memory_order_acquire);
+    if (waitNr == 0 || timeout < 0) {
+        return UringEnter(Fd(), toSubmit, waitNr, waitNr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    }
+    __kernel_timespec ts{timeout / 1000, (timeout % 1000) * 1000000LL};
+    io_uring_getevents_arg arg{};
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+    return UringEnter(Fd(), toSubmit, waitNr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+void UringEvent::Push(int fd, uint8_t op) {
+    {
+        std::lock_guard lock(pendingMutex_);
+        pending_.push_back({fd, op});
+    }
+    // The loop drains the queue before it blocks again, only other threads need to wake it up
+    if (!InLoopThread() && !wakeupPending_.exchange(true)) {
+        Wakeup();
+    }
+}
+
+void UringEvent::DrainMailbox() {
+    mailbox_.Consume([this](SendRequest &&request) {
+        auto &conn = request.conn;
+        if (conn->closed_) {
+            // The manager posts one on close, a write only ring drops the state
+            // of the connection here before the fd can belong to a new one
+            auto iter = fds_.find(conn->fd_);
+            if (iter != fds_.end() && iter->second.sender == conn.get()) {
+                DelEvent(conn->fd_);
+            }
+            return;
+        }
+        // The sends are SENDMSG over memory, a file segment is read in here
+        if (request.file.Valid() && !request.file.Read(&request.msg)) {
+            DoError(conn->fd_, "file read error");
+            return;
+        }
+        // The socket queue is handed to the kernel by StartSend, never written directly.
+        // An empty message only lets a connection whose peer has finished close once the rest is sent
+        if (!request.msg.empty()) {
+            conn->netEvent_->SendPacket(std::move(request.msg));
+        }
+        StartSend(conn->fd_);
+    });
+}
+
+void UringEvent::DrainPending() {
+    std::vector<PendingOp> ops;
+    {
+        std::lock_guard lock(pendingMutex_);
+        wakeupPending_ = false;
+        ops.swap(pending_);
+    }
+    for (const auto &op: ops) {
+        if (op.op == OP_RECV) {
+            ArmRecv(op.fd, ResetState(op.fd));
+        } else if (op.op == OP_SEND) {
+            StartSend(op.fd);
+        }
+    }
+}
+
+UringEvent::FdState &UringEvent::ResetState(int fd) {
+    auto &state = fds_[fd];
+    if (state.sending) {
+        orphanSends_.emplace(state.gen, std::move(state.send));
+    }
+    state = FdState();
+    state.gen = NextGen();
+    return state;
+}
+
+void UringEvent::Reap() {
+    unsigned head = *cqHead_;
+    unsigned tail = std::atomic_ref(*cqTail_).load(std::memory_order_acquire);
+    CountPoll(static_cast<int>(tail - head));
+    for (; head != tail; ++head) {
+        const auto &cqe = cqes_[head & cqMask_];
+        uint64_t userData = cqe.user_data;
+        int res = cqe.res;
+        uint32_t flags = cqe.flags;
+        // Hand the slot back before the callbacks run, they may submit more work
+        std::atomic_ref(*cqHead_).store(head + 1, std::memory_order_release);
+
+        auto fd = static_cast<int>((userData >> 8) & 0xffffff);
+        auto gen = static_cast<uint32_t>(userData >> 32);
+        switch (userData & 0xff) {
+            case OP_WAKEUP:
+                if (running_) {
+                    PrepWakeup();
+                }
+                break;
+            case OP_ACCEPT:
+                OnAccept(fd, gen != 0, res, flags);
+                break;
+            case OP_RECV:
+                OnRecv(fd, gen, res, flags);
+                break;
+            case OP_SEND:
+                OnSend(fd, gen, res);
+                break;
+            case OP_CONNECT:
+                OnConnect(fd, gen);
+                break;
+            case OP_CANCEL:// the cancelled request reports itself
+            default:
+                break;
+        }
+    }
+}
+
+void UringEvent::PrepWakeup() {
+    auto sqe = GetSqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeupFd_[0];
+    sqe->addr = reinterpret_cast<uint64_t>(wakeupBuff_);
+    sqe->len = sizeof(wakeupBuff_);
+    sqe->off = static_cast<uint64_t>(-1);
+    sqe->user_data = UserData(OP_WAKEUP);
+}
+
+void UringEvent::PrepAccept(size_t index) {
+    auto sqe = GetSqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listens_[index]->Fd();
+    sqe->accept_flags = SOCK_NONBLOCK;
+    if (multishotAccept_) {
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    }
+    // The fd field carries the index of the listen socket, the generation whether the accept is multishot
+    sqe->user_data = UserData(OP_ACCEPT, static_cast<int>(index), multishotAccept_ ? 1 : 0);
+}
+
+void UringEvent::PrepRecv(int fd, uint32_t gen) {
+    auto sqe = GetSqe();
+    if (!sqe) {
+        DoError(fd, "submission queue is full");
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufferGroup_;
+    if (multishotRecv_) {
+        sqe->ioprio |= IORING_RECV_MULTISHOT;
+    }
+    sqe->user_data = UserData(OP_RECV, fd, gen);
+}
+
+void UringEvent::ArmRecv(int fd, FdState &state) {
+    if (state.recving || state.paused) {
+        return;
+    }
+    state.recving = true;
+    PrepRecv(fd, state.gen);
+}
+
+void UringEvent::PrepCancel(uint64_t userData) {
+    auto sqe = GetSqe();
+    if (!sqe) {// the recv keeps running, reading resumes a little late
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = userData;
+    sqe->user_data = UserData(OP_CANCEL);
+}
+
+void UringEvent::PrepSend(int fd, FdState &state) {
+    auto sqe = GetSqe();
+    if (!sqe) {// retry on the next round
+        Push(fd, OP_SEND);
+        return;
+    }
+    auto &send = *state.send;
+    send.iov.resize(std::min<size_t>(send.data.Count(), IOV_MAX));
+    send.msg = {};
+    send.msg.msg_iov = send.iov.data();
+    send.msg.msg_iovlen = send.data.Fill(send.iov.data(), static_cast<int>(send.iov.size()));
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&send.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = UserData(OP_SEND, fd, state.gen);
+    state.sending = true;
+}
+
+void UringEvent::PrepConnect(int fd, uint32_t gen) {
+    auto sqe = GetSqe();
+    if (!sqe) {// reported as a connect that has not finished
+        OnConnect(fd, gen);
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;// errors and hangups are always reported
+    sqe->user_data = UserData(OP_CONNECT, fd, gen);
+}
+
+void UringEvent::StartSend(int fd) {
+    auto &state = fds_[fd];// a write only multiplex sees the fd for the first time here
+    if (state.sending) {// the completion picks up the new data
+        return;
+    }
+    if (state.gen == 0) {
+        state.gen = NextGen();
+    }
+    if (!state.send) {
+        state.send = std::make_unique<SendState>();
+    }
+    if (state.send->data.Empty()) {
+        auto conn = getConn_(fd);
+        if (!conn) {
+            return;
+        }
+        state.sender = conn.get();
+        if (!static_cast<StreamSocket *>(conn->netEvent_.get())->TakeSendData(&state.send->data)) {
+            if (Drained(conn.get())) {// the last answer to a peer that has finished
+                DoError(fd, "");
+            }
+            return;
+        }
+    }
+    PrepSend(fd, state);
+}
+
+void UringEvent::OnAccept(size_t index, bool multishot, int res, uint32_t flags) {
+    if (res >= 0) {
+        OnAccepted(index, res);
+    } else if (res == -EMFILE || res == -ENFILE) {
+        // The fd is taken before the backlog is looked at, an accept submitted now would fail
+        // at once again. Refuse what is pending and try again a little later
+        auto listen = static_cast<ListenSocket *>(listens_[index].get());
+        for (int fd = listen->Accept(); fd >= 0 || errno == ECONNABORTED; fd = listen->Accept()) {
+            if (fd >= 0) {// freed meanwhile
+                OnAccepted(index, fd);
+            }
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+            RunTimer(exhaustedWait_, 0, [this, index] {
+                if (running_) {
+                    PrepAccept(index);
+                }
+            });
+        }
+        return;
+    } else if (res == -EINVAL) {
+        if (!multishot) {// the listen socket itself is broken
+            return;
+        }
+        multishotAccept_ = false;
+    }
+    if (!(flags & IORING_CQE_F_MORE) && running_) {
+        PrepAccept(index);
+    }
+}
+
+void UringEvent::OnAccepted(size_t index, int fd) {
+    stats_.accepts.Add(1);
+    auto newConn = Connection::Create(shared_from_this());
+    auto connFd = static_cast<ListenSocket *>(listens_[index].get())->OnAccepted(newConn, fd);
+    onCreate_(connFd, newConn);
+}
+
+void UringEvent::OnRecv(int fd, uint32_t gen, int res, uint32_t flags) {
+    auto iter = fds_.find(fd);
+    bool current = iter != fds_.end() && iter->second.gen == gen;
+    if (current && !(flags & IORING_CQE_F_MORE)) {
+        iter->second.recving = false;
+    }
+
+    if (res > 0) {
+        stats_.reads.Add(1);
+        stats_.bytesRead.Add(res);
+        auto bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+        auto conn = current ? getConn_(fd) : nullptr;
+        if (conn) {
+            std::string readBuff = std::move(conn->readBuff_);// the partial frame of the last read, if any
+            readBuff.append(buffers_.get() + static_cast<size_t>(bid) * bufferSize_, res);
+            RecycleBuffer(bid);
+            ArmRecv(fd, iter->second);
+            onMessage_(conn.get(), std::move(readBuff));
+            return;
+        }
+        RecycleBuffer(bid);
+        if (current) {
+            ArmRecv(fd, iter->second);
+        }
+        return;
+    }
+
+    if (!current) {
+        return;
+    }
+    if (res == -ENOBUFS || res == -ECANCELED) {
+        // All buffers are queued in the CQ and recycled by this round, or reading was paused
+        ArmRecv(fd, iter->second);
+        return;
+    }
+    if (res == -EINVAL && multishotRecv_) {// multishot recv needs kernel 6.0
+        multishotRecv_ = false;
+        ArmRecv(fd, iter->second);
+        return;
+    }
+    if (res == 0) {// the peer shut down its side, what is queued or posted for it still goes out
+        if (auto conn = getConn_(fd)) {
+            if (OnEndOfStream(conn.get())) {
+                onEndOfStream_(conn.get());
+            }
+            return;
+        }
+    }
+    DoError(fd, res == 0 ? "" : "read error");
+}
+
+void UringEvent::OnSend(int fd, uint32_t gen, int res) {
+    auto iter = fds_.find(fd);
+    if (iter == fds_.end() || iter->second.gen != gen) {
+        orphanSends_.erase(gen);
+        return;
+    }
+
+    auto &state = iter->second;
+    state.sending = false;
+    if (res < 0) {
+        if (res == -EINTR || res == -EAGAIN) {
+            PrepSend(fd, state);
+            return;
+        }
+        // The peer is gone, the recv side sees it as well and closes the connection
+        Sent(fd, state.send->data.Size());
+        state.send->data.Clear();
+        return;
+    }
+    stats_.writes.Add(1);
+    stats_.bytesWritten.Add(res);
+    state.send->data.Consume(res);
+    Sent(fd, res);
+    StartSend(fd);
+}
+
+void UringEvent::OnConnect(int fd, uint32_t gen) {
+    auto iter = fds_.find(fd);
+    if (iter == fds_.end() || iter->second.gen != gen || !iter->second.connecting) {// given up already
+        return;
+    }
+    auto conn = iter->second.connecting;
+    fds_.erase(iter);// the connection starts receiving with a state of its own
+    conn->connecting_ = false;
+    onConnect_(conn);
+}
+
+void UringEvent::Sent(int fd, size_t n) {
+    if (auto conn = getConn_(fd)) {
+        static_cast<StreamSocket *>(conn->netEvent_.get())->OnSent(n);
+    }
+}
+
+void UringEvent::RecycleBuffer(uint16_t bid) {
+    // bufs[] is a C flexible array, its offset differs in C++, index the ring directly
+    auto &buf = reinterpret_cast<io_uring_buf *>(bufRing_)[bufTail_ & (bufferEntries_ - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(buffers_.get() + static_cast<size_t>(bid) * bufferSize_);
+    buf.len = bufferSize_;
+    buf.bid = bid;
+    ++bufTail_;
+    std::atomic_ref(bufRing_->tail).store(bufTail_, std::memory_order_release);
+}
+
+void UringEvent::DoError(int fd, std::string &&err) {
+    DelEvent(fd);
+    if (auto conn = getConn_(fd)) {
+        onClose_(conn.get(), std::move(err));
+    }
+}
+
+uint32_t UringEvent::NextGen() {
+    if (++nextGen_ == 0) {// 0 marks a state that has no generation yet
+        ++nextGen_;
+    }
+    return nextGen_;
+}
+
+#endif
@@ -0,0 +1,224 @@
+#pragma once
+
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "base_event.h"
+#include "send_queue.h"
+
+// io_uring multiplexing. Unlike epoll and kqueue it is completion based:
+// the listen socket uses a multishot accept, connections use a multishot recv
+// that picks buffers from a provided buffer ring, and sends are submitted
+// as SENDMSG SQEs over the queued buffers that are batched into one io_uring_enter per loop iteration.
+// Completions only carry the fd, connections are looked up through getConn_
+class UringEvent : public BaseEvent {
+
+public:
+    explicit UringEvent(const ListenSockets &listens, int8_t mode) : BaseEvent(listens, mode,
+                                                                               BaseEvent::EVENT_TYPE_URING) {
+    };
+
+    ~UringEvent() override;
+
+    // Whether the running kernel supports everything this multiplex needs,
+    // the result is probed once and cached
+    static bool Supported();
+
+    // Initialize the ring, the provided buffers and the multishot accept
+    bool Init() override;
+
+    // Start receiving on the fd
+    void AddEvent(Connection *conn, int mask) override;
+
+    // Stop tracking the fd
+    void DelEvent(int fd) override;
+
+    // Poll event
+    void EventPoll() override;
+
+    // Send the pending data of the connection
+    void AddWriteEvent(Connection *conn) override;
+
+    // Sends finish on their own, nothing to do
+    void DelWriteEvent(Connection *conn) override;
+
+    // Cancel the recv of the connection, or start it again
+    void SetReadEnabled(Connection *conn, bool enabled) override;
+
+    // Poll the socket for write readiness, which reports the end of the connect
+    void AddConnectEvent(Connection *conn) override;
+
+private:
+    // Operation of a submission, stored in the low byte of the user_data
+    enum : uint8_t {
+        OP_WAKEUP = 1,
+        OP_ACCEPT,
+        OP_RECV,
+        OP_SEND,
+        OP_CANCEL,
+        OP_CONNECT,
+    };
+
+    // Requests from AddEvent/AddWriteEvent, applied on the loop thread
+    struct PendingOp {
+        int fd;
+        uint8_t op;
+    };
+
+    // Data owned by the kernel until the send completes, allocated once per connection
+    // so that the msghdr keeps its address when the fd is removed with a send in flight
+    // Allocated from the pool of the loop, like everything else kept per connection
+    struct SendState {
+        SendQueue data;
+        std::vector<iovec, PoolAllocator<iovec>> iov;
+        msghdr msg{};
+
+        static void *operator new(size_t size) {
+            return BlockPool::Allocate(size);
+        }
+
+        static void operator delete(void *p) {
+            BlockPool::Deallocate(p);
+        }
+    };
+
+    // Per connection state of the loop, the generation tells
+    // completions of a closed connection apart from a new one reusing the fd
+    struct FdState {
+        uint32_t gen = 0;
+        bool sending = false;
+        bool recving = false;// a recv is submitted and has not ended
+        bool paused = false;// reading stopped by SetReadEnabled
+        Connection *connecting = nullptr;// an outbound connection polled for the end of its connect
+        Connection *sender = nullptr;// the connection the send state takes its data from
+        std::unique_ptr<SendState> send;
+    };
+
+    static uint64_t UserData(uint8_t op, int fd = 0, uint32_t gen = 0) {
+        return (static_cast<uint64_t>(gen) << 32) | (static_cast<uint64_t>(fd) << 8) | op;
+    }
+
+    bool SetupRing();
+
+    bool SetupBufferRing();
+
+    // Get a free SQE, submit the queued ones first if the SQ is full
+    io_uring_sqe *GetSqe();
+
+    // Submit the queued SQEs and wait for at least waitNr completions,
+    // at most timeout ms unless it is negative
+    int Enter(unsigned waitNr, int timeout = -1);
+
+    void Push(int fd, uint8_t op);
+
+    // Start the state of a new connection on the fd, the data of an old one that
+    // the kernel still sends from is kept until its completion
+    FdState &ResetState(int fd);
+
+    void DrainPending();
+
+    // Queue the posted messages on their sockets and start sending them
+    void DrainMailbox() override;
+
+    void Reap();
+
+    void PrepWakeup();
+
+    // Accept on the listen socket at the index of listens_
+    void PrepAccept(size_t index);
+
+    void PrepRecv(int fd, uint32_t gen);
+
+    // Submit a recv unless one is running or reading is paused
+    void ArmRecv(int fd, FdState &state);
+
+    void PrepCancel(uint64_t userData);
+
+    void PrepSend(int fd, FdState &state);
+
+    void PrepConnect(int fd, uint32_t gen);
+
+    // Take more data from the connection and send it
+    void StartSend(int fd);
+
+    void OnAccept(size_t index, bool multishot, int res, uint32_t flags);
+
+    // Create the connection of a fd accepted on the listen socket at the index of listens_
+    void OnAccepted(size_t index, int fd);
+
+    void OnRecv(int fd, uint32_t gen, int res, uint32_t flags);
+
+    void OnSend(int fd, uint32_t gen, int res);
+
+    void OnConnect(int fd, uint32_t gen);
+
+    // Tell the socket that the kernel is done with n bytes of its data
+    void Sent(int fd, size_t n);
+
+    // Give a provided buffer back to the kernel
+    void RecycleBuffer(uint16_t bid);
+
+    void DoError(int fd, std::string &&err);
+
+    uint32_t NextGen();
+
+private:
+    const unsigned ringEntries_ = 1024;
+    const unsigned bufferEntries_ = 256;// must be a power of 2
+    const unsigned bufferSize_ = 16 * 1024;
+    const uint16_t bufferGroup_ = 0;
+    const int64_t exhaustedWait_ = 100;// ms before accepting again while the process is out of fds
+
+    // mapped ring memory
+    void *sqRing_ = nullptr;
+    void *cqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    size_t cqRingSize_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    size_t sqesSize_ = 0;
+
+    unsigned *sqHead_ = nullptr;
+    unsigned *sqTail_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqEntries_ = 0;
+    unsigned sqeTail_ = 0;// local tail, published on Enter
+
+    unsigned *cqHead_ = nullptr;
+    unsigned *cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+
+    // provided buffer ring for multishot recv
+    io_uring_buf_ring *bufRing_ = nullptr;
+    size_t bufRingSize_ = 0;
+    uint16_t bufTail_ = 0;
+    std::unique_ptr<char[]> buffers_;
+
+    // Multishot requests fall back to single shot on kernels that reject them
+    bool multishotAccept_ = true;
+    bool multishotRecv_ = true;
+
+    char wakeupBuff_[64];
+
+    std::mutex pendingMutex_;
+    std::vector<PendingOp> pending_;
+    std::atomic<bool> wakeupPending_ = false;
+
+    // only touched by the loop thread
+    std::unordered_map<int, FdState, std::hash<int>, std::equal_to<int>,
+            PoolAllocator<std::pair<const int, FdState>>> fds_;
+    std::unordered_map<uint32_t, std::unique_ptr<SendState>> orphanSends_;// in-flight sends of removed fds, keyed by generation
+    uint32_t nextGen_ = 0;
+};
+
+#endif
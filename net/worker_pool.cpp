@@ -0,0 +1,98 @@
+#include "worker_pool.h"
+
+namespace {
+
+// The pool and worker index of the calling thread, a submit from a worker goes to its own deque
+thread_local WorkerPool *currentPool = nullptr;
+thread_local size_t currentWorker = 0;
+
+}
+
+WorkerPool::~WorkerPool() {
+    Stop();
+}
+
+bool WorkerPool::Start() {
+    if (threads_ <= 0 || running_.exchange(true)) {
+        return false;
+    }
+    for (int i = 0; i < threads_; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    // Every worker exists before any of them may steal
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        workers_[i]->thread = std::thread([this, i] {
+            Loop(i);
+        });
+    }
+    return true;
+}
+
+void WorkerPool::Stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    signal_.fetch_add(1);
+    signal_.notify_all();
+    for (auto &worker: workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+    }
+}
+
+void WorkerPool::Submit(PoolTask *task) {
+    if (currentPool == this) {
+        workers_[currentWorker]->deque.Push(task);
+    } else {
+        auto index = nextWorker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+        workers_[index]->inbox.Push(std::move(task));
+    }
+    // After the push: a worker that read the old value before it looked for work wakes up again
+    signal_.fetch_add(1);
+    signal_.notify_one();
+}
+
+void WorkerPool::Loop(size_t index) {
+    currentPool = this;
+    currentWorker = index;
+    while (running_.load(std::memory_order_relaxed)) {
+        auto signal = signal_.load();
+        if (auto task = Next(index)) {
+            task->Run();
+            continue;
+        }
+        signal_.wait(signal);
+    }
+}
+
+PoolTask *WorkerPool::Next(size_t index) {
+    auto &worker = workers_[index];
+    if (auto task = worker->deque.Pop()) {
+        return task;
+    }
+    if (TakeInbox(worker.get(), worker.get())) {
+        return worker->deque.Pop();
+    }
+    // A busy worker leaves its inbox alone, take it over before stealing single tasks
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        if (TakeInbox(workers_[(index + i) % workers_.size()].get(), worker.get())) {
+            return worker->deque.Pop();
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        if (auto task = workers_[(index + i) % workers_.size()]->deque.Steal()) {
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+bool WorkerPool::TakeInbox(Worker *inbox, Worker *worker) {
+    bool taken = false;
+    inbox->inbox.Consume([&](PoolTask *task) {
+        worker->deque.Push(task);
+        taken = true;
+    });
+    return taken;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "mpsc_queue.h"
+#include "steal_deque.h"
+
+// Work for the pool. The submitter keeps it alive until Run has returned
+class PoolTask {
+public:
+    virtual ~PoolTask() = default;
+
+    virtual void Run() = 0;
+};
+
+// Threads that run the work handed over by the IO threads. Every worker has a work-stealing deque:
+// what a worker submits goes to its own deque, what other threads submit to the inbox of the next
+// worker in turn. A worker without work empties the inbox of a busy one and steals from the other
+// deques before it sleeps. Submitting takes no lock
+class WorkerPool {
+public:
+    explicit WorkerPool(int threads) : threads_(threads) {}
+
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // Start the workers
+    bool Start();
+
+    // Stop the workers after the tasks they run, the queued ones are dropped
+    void Stop();
+
+    // Queue the task, from any thread
+    void Submit(PoolTask *task);
+
+    inline int Threads() const {
+        return threads_;
+    }
+
+private:
+    struct Worker {
+        StealDeque<PoolTask> deque;// owned by the worker thread
+        MpscQueue<PoolTask *> inbox;// submitted by other threads
+        std::thread thread;
+    };
+
+    void Loop(size_t index);
+
+    // The next task for the worker: its own deque, then the inboxes, then the other deques
+    PoolTask *Next(size_t index);
+
+    // Move the tasks of the inbox into the deque of the worker, return whether there were any.
+    // Consume takes the whole list with one exchange, a worker may take the inbox of another one
+    bool TakeInbox(Worker *inbox, Worker *worker);
+
+private:
+    const int threads_;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    std::atomic<bool> running_ = false;
+
+    std::atomic<uint32_t> nextWorker_ = 0;// round robin of the inboxes
+
+    // Bumped by every submit, a worker that found nothing sleeps until it changes
+    std::atomic<uint32_t> signal_ = 0;
+};